@@ -0,0 +1,616 @@
+// mmap() flags are outside of strict C99.
+#define _DEFAULT_SOURCE
+
+#include "cache.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "chunk.h"
+#include "compiler.h"
+#include "memory.h"
+#include "table.h"
+#include "vm.h"
+
+// File layout, all integers in the byte order of the machine that wrote it:
+//
+// header     ImageHeader
+// functions  an ImageFunction for each function, the script first and each
+//            function ahead of the ones nested in it
+// data       what the records point at: names, code, line runs aligned for
+//            line_pos_t, constants, inline frames and inline runs
+//
+// string     u32 length, or NO_STRING, then the chars
+// constant   u8 ConstantTag, then its payload
+// frame      string name, u32 line, u32 parent
+// run        u32 start, u32 frame
+//
+// Code and line runs are used where they lie in the mapped file, so only
+// constants and inline frames are built at load time.
+#define MAGIC "LOXC"
+#define BYTE_ORDER_MARK 0x01020304u
+#define NO_STRING 0xffffffffu
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    // BYTE_ORDER_MARK as the writer saw it.
+    uint32_t byteOrder;
+    uint32_t functionCount;
+    uint64_t key;
+    // Of the whole file, so a cut short one is turned away up front.
+    uint64_t size;
+    // imageChecksum() of the file. The key only covers the source, and a
+    // damaged image would otherwise run whatever bytecode it holds.
+    uint64_t checksum;
+} ImageHeader;
+
+// Offsets are from the start of the file.
+typedef struct {
+    uint32_t arity;
+    uint32_t upvalueCount;
+    uint32_t readsEnclosingFrame;
+    uint32_t name;
+    uint32_t code;
+    uint32_t codeCount;
+    uint32_t lines;
+    uint32_t lineCount;
+    uint32_t lineOffset;
+    uint32_t constants;
+    uint32_t constantCount;
+    uint32_t frames;
+    uint32_t frameCount;
+    uint32_t runs;
+    uint32_t runCount;
+} ImageFunction;
+
+typedef enum {
+    CONSTANT_NIL,
+    CONSTANT_FALSE,
+    CONSTANT_TRUE,
+    // u32 holding an int32.
+    CONSTANT_INT,
+    // u64 holding the bits of a double.
+    CONSTANT_NUMBER,
+    // An ObjString, which names of globals and fields have to be.
+    CONSTANT_STRING,
+    // A string kept in the value itself, where the build has them.
+    CONSTANT_SHORT_STRING,
+    // u32 index of the function's record.
+    CONSTANT_FUNCTION,
+    // The name of the global holding the native.
+    CONSTANT_NATIVE,
+} ConstantTag;
+
+uint64_t bytecodeKey(const char *source) {
+    // FNV-1a over the source, then the options that change the code.
+    uint64_t hash = 14695981039346656037ull;
+    for (const char *c = source; *c != '\0'; c++) {
+        hash ^= (uint8_t)*c;
+        hash *= 1099511628211ull;
+    }
+    uint8_t options[] = {compilerOptions.peephole, compilerOptions.optimize};
+    for (size_t i = 0; i < sizeof(options); i++) {
+        hash ^= options[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// FNV-1a over 8 byte words, then the bytes left over.
+static uint64_t checksumBytes(uint64_t hash, const uint8_t *bytes,
+                              size_t count) {
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= count; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, &bytes[i], sizeof(word));
+        hash = (hash ^ word) * 1099511628211ull;
+    }
+    for (; i < count; i++) hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+}
+
+// Checksum of a whole image, taking its header's checksum field as 0.
+static uint64_t imageChecksum(const uint8_t *data, size_t size) {
+    ImageHeader header;
+    memcpy(&header, data, sizeof(header));
+    header.checksum = 0;
+    uint64_t hash = checksumBytes(14695981039346656037ull,
+                                  (const uint8_t *)&header, sizeof(header));
+    return checksumBytes(hash, &data[sizeof(header)], size - sizeof(header));
+}
+
+// The file being written, built up in memory before it goes out in one go.
+typedef struct {
+    uint8_t *bytes;
+    size_t count;
+    size_t capacity;
+    // Set once memory runs out or the file outgrows 32-bit offsets.
+    bool failed;
+} Image;
+
+// Appends `count` bytes, or zeros when `bytes` is NULL.
+static void writeBytes(Image *image, const void *bytes, size_t count) {
+    if (image->failed || count == 0) return;
+    if (count > UINT32_MAX - image->count) {
+        image->failed = true;
+        return;
+    }
+    if (image->count + count > image->capacity) {
+        size_t capacity = image->capacity < 256 ? 256 : image->capacity;
+        while (capacity < image->count + count) capacity *= 2;
+        uint8_t *grown = (uint8_t *)realloc(image->bytes, capacity);
+        if (grown == NULL) {
+            image->failed = true;
+            return;
+        }
+        image->bytes = grown;
+        image->capacity = capacity;
+    }
+    if (bytes == NULL) {
+        memset(&image->bytes[image->count], 0, count);
+    } else {
+        memcpy(&image->bytes[image->count], bytes, count);
+    }
+    image->count += count;
+}
+
+static void writeU8(Image *image, uint8_t value) {
+    writeBytes(image, &value, 1);
+}
+
+static void writeU32(Image *image, uint32_t value) {
+    writeBytes(image, &value, sizeof(value));
+}
+
+static void writeU64(Image *image, uint64_t value) {
+    writeBytes(image, &value, sizeof(value));
+}
+
+// Pads to a multiple of `alignment` and returns the offset there.
+static uint32_t alignImage(Image *image, size_t alignment) {
+    writeBytes(image, NULL, (alignment - image->count % alignment) % alignment);
+    return (uint32_t)image->count;
+}
+
+static void writeString(Image *image, ObjString *string) {
+    if (string == NULL) {
+        writeU32(image, NO_STRING);
+        return;
+    }
+    writeU32(image, (uint32_t)string->length);
+    writeBytes(image, string->chars, string->length);
+}
+
+// The global a native is bound to. Scripts may rebind native globals, but an
+// image is saved before its script runs, when every native is still where
+// defineNatives() put it, and the compiler never binds a call to a native
+// the script rebinds.
+static ObjString *nativeName(Value native) {
+    for (int i = 0; i < vm.globals.capacity; i++) {
+        Entry *entry = &vm.globals.entries[i];
+        if (entry->key != NULL && valuesEqual(entry->value, native)) {
+            return entry->key;
+        }
+    }
+    return NULL;
+}
+
+// Everything but functions, which the caller numbers.
+static bool writeConstant(Image *image, Value value) {
+    if (IS_NIL(value)) {
+        writeU8(image, CONSTANT_NIL);
+    } else if (IS_BOOL(value)) {
+        writeU8(image, AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE);
+    } else if (IS_INT(value)) {
+        writeU8(image, CONSTANT_INT);
+        writeU32(image, (uint32_t)AS_INT(value));
+    } else if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        writeU8(image, CONSTANT_NUMBER);
+        writeU64(image, bits);
+    } else if (IS_SHORT_STRING(value)) {
+        char chars[SHORT_STRING_MAX + 1];
+        shortStringChars(value, chars);
+        int length = SHORT_STRING_LENGTH(value);
+        writeU8(image, CONSTANT_SHORT_STRING);
+        writeU32(image, (uint32_t)length);
+        writeBytes(image, chars, length);
+    } else if (IS_STRING(value)) {
+        writeU8(image, CONSTANT_STRING);
+        writeString(image, AS_STRING(value));
+    } else if (IS_NATIVE(value)) {
+        ObjString *name = nativeName(value);
+        if (name == NULL) return false;
+        writeU8(image, CONSTANT_NATIVE);
+        writeString(image, name);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static int countFunctions(ObjFunction *function) {
+    ValueArray *constants = &function->chunk.constants;
+    int count = 1;
+    for (int i = 0; i < constants->count; i++) {
+        if (IS_FUNCTION(constants->values[i])) {
+            count += countFunctions(AS_FUNCTION(constants->values[i]));
+        }
+    }
+    return count;
+}
+
+// Lists `function` at `index` and the functions nested in it after it,
+// noting how many each one spans, itself included.
+static int listFunctions(ObjFunction **functions, int *sizes, int index,
+                         ObjFunction *function) {
+    ValueArray *constants = &function->chunk.constants;
+    functions[index] = function;
+    int size = 1;
+    for (int i = 0; i < constants->count; i++) {
+        if (IS_FUNCTION(constants->values[i])) {
+            size += listFunctions(functions, sizes, index + size,
+                                  AS_FUNCTION(constants->values[i]));
+        }
+    }
+    sizes[index] = size;
+    return size;
+}
+
+static bool writeFunction(Image *image, ImageFunction *record,
+                          ObjFunction **functions, int *sizes, int index) {
+    ObjFunction *function = functions[index];
+    Chunk *chunk = &function->chunk;
+    record->arity = (uint32_t)function->arity;
+    record->upvalueCount = (uint32_t)function->upvalueCount;
+    record->readsEnclosingFrame = function->readsEnclosingFrame;
+    record->name = (uint32_t)image->count;
+    writeString(image, DEREF(ObjString, function->name));
+
+    record->code = (uint32_t)image->count;
+    record->codeCount = (uint32_t)chunk->count;
+    writeBytes(image, chunk->code, chunk->count);
+    record->lines = alignImage(image, sizeof(line_pos_t));
+    record->lineCount = (uint32_t)chunk->lines.count;
+    record->lineOffset = (uint32_t)chunk->lines.offset;
+    writeBytes(image, chunk->lines.lines,
+               chunk->lines.count * sizeof(line_pos_t));
+
+    // Nested functions were listed in the order they appear here.
+    int child = index + 1;
+    record->constants = (uint32_t)image->count;
+    record->constantCount = (uint32_t)chunk->constants.count;
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        if (IS_FUNCTION(value)) {
+            writeU8(image, CONSTANT_FUNCTION);
+            writeU32(image, (uint32_t)child);
+            child += sizes[child];
+        } else if (!writeConstant(image, value)) {
+            return false;
+        }
+    }
+
+    record->frames = (uint32_t)image->count;
+    record->frameCount = (uint32_t)chunk->inlineFrameCount;
+    for (int i = 0; i < chunk->inlineFrameCount; i++) {
+        InlineFrame *frame = &chunk->inlineFrames[i];
+        writeString(image, DEREF(ObjString, frame->name));
+        writeU32(image, (uint32_t)frame->line);
+        writeU32(image, (uint32_t)frame->parent);
+    }
+    record->runs = (uint32_t)image->count;
+    record->runCount = (uint32_t)chunk->inlineRunCount;
+    for (int i = 0; i < chunk->inlineRunCount; i++) {
+        writeU32(image, (uint32_t)chunk->inlineRuns[i].start);
+        writeU32(image, (uint32_t)chunk->inlineRuns[i].frame);
+    }
+    return !image->failed;
+}
+
+static bool buildImage(Image *image, ObjFunction *script, uint64_t key) {
+    int count = countFunctions(script);
+    ObjFunction **functions =
+        (ObjFunction **)malloc(count * sizeof(ObjFunction *));
+    int *sizes = (int *)malloc(count * sizeof(int));
+    bool built = functions != NULL && sizes != NULL;
+    if (built) listFunctions(functions, sizes, 0, script);
+
+    // The header and records are filled in once the data behind them is.
+    size_t table = sizeof(ImageHeader);
+    writeBytes(image, NULL, table + count * sizeof(ImageFunction));
+    for (int i = 0; i < count && built; i++) {
+        ImageFunction record;
+        built = writeFunction(image, &record, functions, sizes, i);
+        if (built) {
+            memcpy(&image->bytes[table + i * sizeof(ImageFunction)], &record,
+                   sizeof(record));
+        }
+    }
+    if (built) {
+        ImageHeader header;
+        memcpy(header.magic, MAGIC, 4);
+        header.version = BYTECODE_VERSION;
+        header.byteOrder = BYTE_ORDER_MARK;
+        header.functionCount = (uint32_t)count;
+        header.key = key;
+        header.size = image->count;
+        header.checksum = 0;
+        memcpy(image->bytes, &header, sizeof(header));
+        header.checksum = imageChecksum(image->bytes, image->count);
+        memcpy(image->bytes, &header, sizeof(header));
+    }
+    free(functions);
+    free(sizes);
+    return built;
+}
+
+bool saveBytecode(const char *path, ObjFunction *script, uint64_t key) {
+    Image image = {NULL, 0, 0, false};
+    if (!buildImage(&image, script, key)) {
+        free(image.bytes);
+        return false;
+    }
+
+    size_t length = strlen(path) + 32;
+    char *temporary = (char *)malloc(length);
+    FILE *file = NULL;
+    if (temporary != NULL) {
+        snprintf(temporary, length, "%s.%ld.tmp", path, (long)getpid());
+        file = fopen(temporary, "wb");
+    }
+    if (file == NULL) {
+        free(temporary);
+        free(image.bytes);
+        return false;
+    }
+    bool written = fwrite(image.bytes, 1, image.count, file) == image.count;
+    written &= fclose(file) == 0;
+    free(image.bytes);
+
+    // Never rewritten in place: a running process may have the old file
+    // mapped, and the rename leaves it the copy it has.
+    written = written && rename(temporary, path) == 0;
+    if (!written) remove(temporary);
+    free(temporary);
+    return written;
+}
+
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    size_t position;
+    // Set once anything runs past the end or doesn't make sense; reads
+    // return 0 from then on.
+    bool failed;
+} Reader;
+
+static const uint8_t *readBytes(Reader *reader, size_t count) {
+    if (reader->failed || reader->size - reader->position < count) {
+        reader->failed = true;
+        return NULL;
+    }
+    const uint8_t *bytes = &reader->data[reader->position];
+    reader->position += count;
+    return bytes;
+}
+
+static uint8_t readU8(Reader *reader) {
+    const uint8_t *bytes = readBytes(reader, 1);
+    return bytes == NULL ? 0 : bytes[0];
+}
+
+static uint32_t readU32(Reader *reader) {
+    const uint8_t *bytes = readBytes(reader, sizeof(uint32_t));
+    uint32_t value = 0;
+    if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static uint64_t readU64(Reader *reader) {
+    const uint8_t *bytes = readBytes(reader, sizeof(uint64_t));
+    uint64_t value = 0;
+    if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+// Moves to a table of `count` items at least `size` bytes each, checking
+// that it fits in the file. Returns the count.
+static int seekTable(Reader *reader, uint32_t offset, uint32_t count,
+                     size_t size) {
+    if (reader->failed || offset > reader->size || count > INT32_MAX ||
+        count > (reader->size - offset) / size) {
+        reader->failed = true;
+        return 0;
+    }
+    reader->position = offset;
+    return (int)count;
+}
+
+static ObjString *readString(Reader *reader) {
+    uint32_t length = readU32(reader);
+    if (length == NO_STRING) return NULL;
+    if (length > INT32_MAX) reader->failed = true;
+    const char *chars = (const char *)readBytes(reader, length);
+    if (chars == NULL) return NULL;
+    return copyString(chars, (int)length);
+}
+
+// A constant of function `index`, which may only refer to functions listed
+// after it.
+static Value readConstant(Reader *reader, ObjList *functions, int index) {
+    switch (readU8(reader)) {
+        case CONSTANT_NIL:
+            return NIL_VAL;
+        case CONSTANT_FALSE:
+            return BOOL_VAL(false);
+        case CONSTANT_TRUE:
+            return BOOL_VAL(true);
+        case CONSTANT_INT:
+            return INT_VAL((int32_t)readU32(reader));
+        case CONSTANT_NUMBER: {
+            uint64_t bits = readU64(reader);
+            double number;
+            memcpy(&number, &bits, sizeof(number));
+            return NUMBER_VAL(number);
+        }
+        case CONSTANT_STRING: {
+            ObjString *string = readString(reader);
+            if (string == NULL) reader->failed = true;
+            return string == NULL ? NIL_VAL : OBJ_VAL(string);
+        }
+        case CONSTANT_SHORT_STRING: {
+            uint32_t length = readU32(reader);
+            const char *chars = (const char *)readBytes(reader, length);
+            if (chars == NULL || !FITS_SHORT_STRING(length)) {
+                reader->failed = true;
+                return NIL_VAL;
+            }
+            return shortStringToValue(chars, (int)length);
+        }
+        case CONSTANT_FUNCTION: {
+            uint32_t function = readU32(reader);
+            if (function <= (uint32_t)index ||
+                function >= (uint32_t)functions->items.count) {
+                reader->failed = true;
+                return NIL_VAL;
+            }
+            return functions->items.values[function];
+        }
+        case CONSTANT_NATIVE: {
+            ObjString *name = readString(reader);
+            Value native;
+            if (name == NULL || !tableGet(&vm.globals, name, &native) ||
+                !IS_NATIVE(native)) {
+                reader->failed = true;
+                return NIL_VAL;
+            }
+            return native;
+        }
+        default:
+            reader->failed = true;
+            return NIL_VAL;
+    }
+}
+
+static void readFunction(Reader *reader, ObjList *functions, int index,
+                         const ImageFunction *record) {
+    ObjFunction *function = AS_FUNCTION(functions->items.values[index]);
+    Chunk *chunk = &function->chunk;
+    function->arity = (int)record->arity;
+    function->upvalueCount = (int)record->upvalueCount;
+    function->readsEnclosingFrame = record->readsEnclosingFrame != 0;
+    seekTable(reader, record->name, 0, 1);
+    function->name = REF(readString(reader));
+
+    // Pointed straight into the file rather than copied.
+    chunk->mapped = true;
+    int count = seekTable(reader, record->code, record->codeCount, 1);
+    chunk->code = (uint8_t *)readBytes(reader, count);
+    chunk->count = count;
+    if (record->lines % sizeof(line_pos_t) != 0) reader->failed = true;
+    int lines = seekTable(reader, record->lines, record->lineCount,
+                          sizeof(line_pos_t));
+    chunk->lines.lines =
+        (line_pos_t *)readBytes(reader, lines * sizeof(line_pos_t));
+    chunk->lines.count = lines;
+    chunk->lines.offset = (int)record->lineOffset;
+
+    int constants =
+        seekTable(reader, record->constants, record->constantCount, 1);
+    for (int i = 0; i < constants && !reader->failed; i++) {
+        addConstant(chunk, readConstant(reader, functions, index));
+    }
+
+    int frames = seekTable(reader, record->frames, record->frameCount, 12);
+    if (!reader->failed && frames > 0) {
+        // Counted in full up front so the names are traced as they come in.
+        chunk->inlineFrames = ALLOCATE(InlineFrame, frames);
+        for (int i = 0; i < frames; i++) {
+            chunk->inlineFrames[i].name = REF(NULL);
+        }
+        chunk->inlineFrameCount = frames;
+        for (int i = 0; i < frames; i++) {
+            chunk->inlineFrames[i].name = REF(readString(reader));
+            chunk->inlineFrames[i].line = (int)readU32(reader);
+            chunk->inlineFrames[i].parent = (int)readU32(reader);
+        }
+    }
+    int runs = seekTable(reader, record->runs, record->runCount, 8);
+    if (!reader->failed && runs > 0) {
+        chunk->inlineRuns = ALLOCATE(InlineRun, runs);
+        chunk->inlineRunCount = runs;
+        for (int i = 0; i < runs; i++) {
+            chunk->inlineRuns[i].start = (int)readU32(reader);
+            chunk->inlineRuns[i].frame = (int)readU32(reader);
+        }
+    }
+}
+
+static ObjFunction *readImage(const uint8_t *data, size_t size, int count) {
+    // Every function exists before any constant refers to one, kept alive
+    // by the list until the script holds them.
+    ObjList *functions = newList();
+    push(OBJ_VAL(functions));
+    for (int i = 0; i < count; i++) {
+        ObjFunction *function = newFunction();
+        push(OBJ_VAL(function));
+        writeValueArray(&functions->items, OBJ_VAL(function));
+        pop();
+    }
+
+    Reader reader = {data, size, 0, false};
+    for (int i = 0; i < count && !reader.failed; i++) {
+        ImageFunction record;
+        memcpy(&record,
+               &data[sizeof(ImageHeader) + i * sizeof(ImageFunction)],
+               sizeof(record));
+        readFunction(&reader, functions, i, &record);
+    }
+    ObjFunction *script =
+        reader.failed ? NULL : AS_FUNCTION(functions->items.values[0]);
+    pop();
+    return script;
+}
+
+ObjFunction *loadBytecode(const char *path, uint64_t key) {
+    int file = open(path, O_RDONLY);
+    if (file < 0) return NULL;
+    struct stat status;
+    void *data = MAP_FAILED;
+    if (fstat(file, &status) == 0 &&
+        status.st_size >= (off_t)sizeof(ImageHeader)) {
+        data = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE,
+                    file, 0);
+    }
+    close(file);
+    if (data == MAP_FAILED) return NULL;
+
+    size_t size = (size_t)status.st_size;
+    ImageHeader header;
+    memcpy(&header, data, sizeof(header));
+    ObjFunction *script = NULL;
+    if (memcmp(header.magic, MAGIC, 4) == 0 &&
+        header.version == BYTECODE_VERSION &&
+        header.byteOrder == BYTE_ORDER_MARK && header.key == key &&
+        header.size == size && header.functionCount > 0 &&
+        header.functionCount <=
+            (size - sizeof(header)) / sizeof(ImageFunction) &&
+        header.checksum == imageChecksum((const uint8_t *)data, size)) {
+        script = readImage((const uint8_t *)data, size,
+                           (int)header.functionCount);
+    }
+    // The script's code runs out of the mapping, so a loaded one stays
+    // mapped for the rest of the run. Functions of a file that failed
+    // never run, and their chunks don't free what was mapped.
+    if (script == NULL) munmap(data, size);
+    return script;
+}
@@ -0,0 +1,27 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "value.h"
+
+// Compiled scripts saved as .loxc files, so a script that hasn't changed
+// skips the compiler on later runs. A file holds the whole ObjFunction tree:
+// code, line runs, inline frames and constants, nested functions included.
+// It is keyed by a hash of the source and of the compiler options that shape
+// the code, and a file with any other key, or whose checksum doesn't match,
+// is ignored.
+//
+// Files are mapped rather than read, and the code and line tables are used
+// where they lie, so processes running the same script share those pages.
+
+// Bumped whenever the bytecode or the file layout changes.
+#define BYTECODE_VERSION 3
+
+// Key for `source` compiled with the current compilerOptions.
+uint64_t bytecodeKey(const char *source);
+// Writes the script to `path`, replacing it in one step so a concurrent
+// reader never sees half a file. Returns false if it couldn't.
+bool saveBytecode(const char *path, ObjFunction *script, uint64_t key);
+// The script saved at `path` under `key`, or NULL when there is none.
+ObjFunction *loadBytecode(const char *path, uint64_t key);
+
+#endif
@@ -11,6 +11,11 @@ void initChunk(Chunk *chunk) {
     chunk->code = NULL;
     initLines(&chunk->lines);
     initValueArray(&chunk->constants);
+    chunk->inlineFrames = NULL;
+    chunk->inlineFrameCount = 0;
+    chunk->inlineRuns = NULL;
+    chunk->inlineRunCount = 0;
+    chunk->mapped = false;
 }
 
 void writeChunk(Chunk *chunk, uint8_t byte, int line) {
@@ -26,20 +31,123 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line) {
     chunk->count++;
 }
 
+void truncateChunk(Chunk *chunk, int count) {
+    chunk->count = count;
+    truncateLines(&chunk->lines, count);
+}
+
 void freeChunk(Chunk *chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    freeLines(&chunk->lines);
+    if (!chunk->mapped) {
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+        freeLines(&chunk->lines);
+    }
     freeValueArray(&chunk->constants);
+    freeInlineFrames(chunk);
     initChunk(chunk);
 }
 
+void freeInlineFrames(Chunk *chunk) {
+    FREE_ARRAY(InlineFrame, chunk->inlineFrames, chunk->inlineFrameCount);
+    FREE_ARRAY(InlineRun, chunk->inlineRuns, chunk->inlineRunCount);
+    chunk->inlineFrames = NULL;
+    chunk->inlineFrameCount = 0;
+    chunk->inlineRuns = NULL;
+    chunk->inlineRunCount = 0;
+}
+
 int getLine(const Chunk *chunk, int offset) {
     return getLineByOffset(&chunk->lines, offset);
 }
 
+int getInlineFrame(const Chunk *chunk, int offset) {
+    int frame = -1;
+    for (int i = 0; i < chunk->inlineRunCount; i++) {
+        if (chunk->inlineRuns[i].start > offset) break;
+        frame = chunk->inlineRuns[i].frame;
+    }
+    return frame;
+}
+
 int addConstant(Chunk *chunk, Value value) {
     push(value);
     writeValueArray(&chunk->constants, value);
     pop();
     return chunk->constants.count - 1;
-}
\ No newline at end of file
+}
+// Size in bytes of the instruction at `offset`, operands included.
+int instructionLength(const Chunk *chunk, int offset) {
+    switch ((OpCode)chunk->code[offset]) {
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_POP:
+        case OP_EQUAL:
+        case OP_BANG_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_PRINT:
+        case OP_GET_INDEX:
+        case OP_SET_INDEX:
+        case OP_LIST_APPEND:
+        case OP_LENGTH:
+        case OP_CLOSE_UPVALUE:
+        case OP_INHERIT:
+        case OP_RETURN:
+            return 1;
+
+        case OP_CONSTANT:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_OUTER_LOCAL:
+        case OP_SET_OUTER_LOCAL:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_BUILD_LIST:
+        case OP_BUILD_MAP:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CALL_NATIVE:
+        case OP_CLASS:
+        case OP_METHOD:
+            return 2;
+
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_LOOP:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+            return 3;
+
+        case OP_CLOSURE:
+        case OP_FRAME_CLOSURE: {
+            Value function = chunk->constants.values[chunk->code[offset + 1]];
+            return 2 + 2 * AS_FUNCTION(function)->upvalueCount;
+        }
+
+        case OP_WIDE: {
+            const uint8_t *code = &chunk->code[offset];
+            if (code[3] == OP_CLOSURE || code[3] == OP_FRAME_CLOSURE) {
+                int constant = (code[1] << 16) | (code[2] << 8) | code[4];
+                Value function = chunk->constants.values[constant];
+                return 5 + 2 * AS_FUNCTION(function)->upvalueCount;
+            }
+            return 3 + instructionLength(chunk, offset + 3);
+        }
+    }
+    return 1;  // Unreachable.
+}
@@ -7,6 +7,8 @@
 
 typedef enum {
     OP_CONSTANT,
+    // Prefix giving the next instruction's constant operand 16 more bits.
+    OP_WIDE,
     OP_NIL,
     OP_TRUE,
     OP_FALSE,
@@ -15,12 +17,20 @@ typedef enum {
     OP_SET_GLOBAL,
     OP_GET_UPVALUE,
     OP_SET_UPVALUE,
+    OP_GET_OUTER_LOCAL,
+    OP_SET_OUTER_LOCAL,
     OP_DEFINE_GLOBAL,
     OP_GET_LOCAL,
     OP_SET_LOCAL,
     OP_GET_PROPERTY,
     OP_SET_PROPERTY,
     OP_GET_SUPER,
+    OP_BUILD_LIST,
+    OP_BUILD_MAP,
+    OP_GET_INDEX,
+    OP_SET_INDEX,
+    OP_LIST_APPEND,
+    OP_LENGTH,
     OP_EQUAL,
     OP_BANG_EQUAL,
     OP_GREATER,
@@ -36,11 +46,15 @@ typedef enum {
     OP_PRINT,
     OP_JUMP,
     OP_JUMP_IF_FALSE,
+    OP_JUMP_IF_TRUE,
     OP_LOOP,
     OP_CALL,
+    OP_TAIL_CALL,
+    OP_CALL_NATIVE,
     OP_INVOKE,
     OP_SUPER_INVOKE,
     OP_CLOSURE,
+    OP_FRAME_CLOSURE,
     OP_CLOSE_UPVALUE,
     OP_CLASS,
     OP_INHERIT,
@@ -48,18 +62,22 @@ typedef enum {
     OP_RETURN,
 } OpCode;
 
-typedef struct {
-    int count;
-    int capacity;
-    uint8_t *code;
-    Lines lines;
-    ValueArray constants;
-} Chunk;
+// Constant operands are one byte, or three behind an OP_WIDE prefix.
+#define MAX_CONSTANTS (1 << 24)
+
+// struct Chunk is laid out in value.h, embedded into ObjFunction.
+typedef struct Chunk Chunk;
 
 void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
+// Drops the code from `count` on so it can be written again.
+void truncateChunk(Chunk *chunk, int count);
 int addConstant(Chunk *chunk, Value value);
 int getLine(const Chunk *chunk, int offset);
+// The innermost inlined call the code at `offset` came from, or -1.
+int getInlineFrame(const Chunk *chunk, int offset);
+void freeInlineFrames(Chunk *chunk);
+int instructionLength(const Chunk *chunk, int offset);
 
 #endif
\ No newline at end of file
@@ -7,6 +7,8 @@
 #include <stdio.h>
 
 #define NAN_BOXING
+// Store references between objects as 32 bit offsets into the object heap.
+// #define COMPRESSED_REFS
 
 #ifdef DEBUG
 #define DEBUG_PRINT_CODE
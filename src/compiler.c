@@ -5,7 +5,10 @@
 #include <string.h>
 
 #include "common.h"
+#include "optimizer.h"
+#include "peephole.h"
 #include "scanner.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -44,6 +47,9 @@ typedef struct {
     Token name;
     int depth;
     bool isCaptured;
+    // Offset of the OP_CLOSURE of a local `fun` that has so far only been
+    // called directly; -1 once it may escape the frame.
+    int closure;
 } Local;
 
 typedef struct {
@@ -68,6 +74,19 @@ typedef struct {
     int localCount;
 
     Upvalue upvalues[UINT8_COUNT];
+    // A nested function captures one of our upvalues.
+    bool sharesUpvalues;
+    // Offset of the latest OP_CALL, to spot `return f(...)`.
+    int lastCall;
+    // A native about to be called, bound at compile time, and the code
+    // offset at which its call() has to follow.
+    ObjNative* calleeNative;
+    int calleeNativeAt;
+    // Constant value to its index in the chunk, so each is stored once.
+    ValueTable constantIndex;
+    // Offset of the constant load that is the last instruction emitted, with
+    // no jump landing after it, or -1. Folding takes it back.
+    int lastConstant;
 
     int scopeDepth;
 } Compiler;
@@ -77,6 +96,13 @@ typedef struct ClassCompiler {
     bool hasSuperclass;
 } ClassCompiler;
 
+CompilerOptions compilerOptions = {
+    .peephole = true,
+    .optimize = false,
+    .printInlining = false,
+    .bindNatives = true,
+};
+
 Parser parser;
 Compiler* current = NULL;
 ClassCompiler* currentClass = NULL;
@@ -96,17 +122,24 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     compiler->function = NULL;
     compiler->type = type;
     compiler->localCount = 0;
+    compiler->sharesUpvalues = false;
+    compiler->lastCall = -1;
+    compiler->calleeNative = NULL;
+    compiler->calleeNativeAt = -1;
+    initValueTable(&compiler->constantIndex);
+    compiler->lastConstant = -1;
     compiler->scopeDepth = 0;
     compiler->function = newFunction();
     current = compiler;
     if (type != TYPE_SCRIPT) {
         current->function->name =
-            copyString(parser.previous.start, parser.previous.length);
+            REF(copyString(parser.previous.start, parser.previous.length));
     }
 
     Local* local = &current->locals[current->localCount++];
     local->depth = 0;
     local->isCaptured = false;
+    local->closure = -1;
     if (type != TYPE_FUNCTION) {
         local->name.start = "this";
         local->name.length = 4;
@@ -178,6 +211,9 @@ static void variable(bool canAssign);
 static void and_(bool canAssign);
 static void or_(bool canAssign);
 static void dot(bool canAssign);
+static void list(bool canAssign);
+static void map(bool canAssign);
+static void subscript(bool canAssign);
 static void this_(bool canAssign);
 static void super_(bool canAssign);
 // other forward declarations
@@ -188,6 +224,7 @@ ParseRule rules[] = {
     [TOKEN_BANG_EQUAL] = {NULL, binary, PREC_EQUALITY},
     [TOKEN_BANG] = {unary, NULL, PREC_NONE},
     [TOKEN_CLASS] = {NULL, NULL, PREC_NONE},
+    [TOKEN_COLON] = {NULL, NULL, PREC_NONE},
     [TOKEN_COMMA] = {NULL, NULL, PREC_NONE},
     [TOKEN_DOT] = {NULL, dot, PREC_CALL},
     [TOKEN_ELSE] = {NULL, NULL, PREC_NONE},
@@ -205,7 +242,8 @@ ParseRule rules[] = {
     [TOKEN_IDENTIFIER] = {variable, NULL, PREC_NONE},
     [TOKEN_IF] = {NULL, NULL, PREC_NONE},
     [TOKEN_NIL] = {literal, NULL, PREC_NONE},
-    [TOKEN_LEFT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACE] = {map, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACKET] = {list, subscript, PREC_CALL},
     [TOKEN_LEFT_PAREN] = {grouping, call, PREC_CALL},
     [TOKEN_MINUS] = {unary, binary, PREC_TERM},
     [TOKEN_NUMBER] = {number, NULL, PREC_NONE},
@@ -214,6 +252,7 @@ ParseRule rules[] = {
     [TOKEN_PRINT] = {NULL, NULL, PREC_NONE},
     [TOKEN_RETURN] = {NULL, NULL, PREC_NONE},
     [TOKEN_RIGHT_BRACE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_RIGHT_BRACKET] = {NULL, NULL, PREC_NONE},
     [TOKEN_RIGHT_PAREN] = {NULL, NULL, PREC_NONE},
     [TOKEN_SEMICOLON] = {NULL, NULL, PREC_NONE},
     [TOKEN_SLASH] = {NULL, binary, PREC_FACTOR},
@@ -228,6 +267,7 @@ ParseRule rules[] = {
 
 static void emitByte(uint8_t byte) {
     writeChunk(currentChunk(), byte, parser.previous.line);
+    current->lastConstant = -1;
 }
 
 static void emitBytes(uint8_t byte1, uint8_t byte2) {
@@ -262,6 +302,8 @@ static void patchJump(int offset) {
 
     currentChunk()->code[offset] = (jump >> 8) & 0xff;
     currentChunk()->code[offset + 1] = jump & 0xff;
+    // The value here may come from either path.
+    current->lastConstant = -1;
 }
 
 static void emitReturn() {
@@ -273,18 +315,80 @@ static void emitReturn() {
     emitByte(OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value) {
+// Numbers and strings are shared; functions are unique anyway.
+static bool isSharedConstant(Value value) {
+    if (IS_OBJ(value)) return IS_STRING(value);
+    // -0 == 0, so it would be taken for 0.
+    return !IS_NUMBER(value) || AS_NUMBER(value) != 0 ||
+           1 / AS_NUMBER(value) > 0;
+}
+
+static int makeConstant(Value value) {
+    bool shared = isSharedConstant(value);
+    Value index;
+    if (shared && valueTableGet(&current->constantIndex, value, &index)) {
+        return (int)AS_NUMBER(index);
+    }
+
     int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX) {
+    if (constant > MAX_CONSTANTS - 1) {
         error("Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t)constant;
+    // The chunk holds on to the value if the table allocates.
+    if (shared) {
+        valueTableSet(&current->constantIndex, value, NUMBER_VAL(constant));
+    }
+    return constant;
+}
+
+// Emits an instruction whose operand is a constant index. Indexes past a byte
+// are prefixed with OP_WIDE carrying their upper 16 bits.
+static void emitConstantOp(uint8_t op, int constant) {
+    if (constant > UINT8_MAX) {
+        emitByte(OP_WIDE);
+        emitBytes((constant >> 16) & 0xff, (constant >> 8) & 0xff);
+    }
+    emitBytes(op, constant & 0xff);
 }
 
 static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    int start = currentChunk()->count;
+    if (IS_NIL(value)) {
+        emitByte(OP_NIL);
+    } else if (IS_BOOL(value)) {
+        emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else {
+        emitConstantOp(OP_CONSTANT, makeConstant(value));
+    }
+    current->lastConstant = start;
+}
+
+// The value loaded by the constant instruction at `offset`.
+static Value constantAt(int offset) {
+    Chunk* chunk = currentChunk();
+    uint8_t* code = &chunk->code[offset];
+    switch (code[0]) {
+        case OP_NIL:
+            return NIL_VAL;
+        case OP_TRUE:
+            return BOOL_VAL(true);
+        case OP_FALSE:
+            return BOOL_VAL(false);
+        case OP_WIDE:
+            return chunk->constants
+                .values[(code[1] << 16) | (code[2] << 8) | code[4]];
+        default:
+            return chunk->constants.values[code[1]];
+    }
+}
+
+// Takes back the code from `offset` on.
+static void rewindCode(int offset) {
+    truncateChunk(currentChunk(), offset);
+    if (current->lastCall >= offset) current->lastCall = -1;
+    current->lastConstant = -1;
 }
 
 static ParseRule* getRule(TokenType type) { return &rules[type]; }
@@ -311,7 +415,7 @@ static void parsePrecedence(Precedence precedence) {
     }
 }
 
-static uint8_t identifierConstant(Token* name) {
+static int identifierConstant(Token* name) {
     return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
 }
 
@@ -357,14 +461,17 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
 static int resolveUpvalue(Compiler* compiler, Token* name) {
     if (compiler->enclosing == NULL) return -1;
 
-    int local = resolveLocal((Compiler*)compiler->enclosing, name);
+    Compiler* enclosing = (Compiler*)compiler->enclosing;
+    int local = resolveLocal(enclosing, name);
     if (local != -1) {
-        ((Compiler*)compiler->enclosing)->locals[local].isCaptured = true;
+        enclosing->locals[local].isCaptured = true;
+        enclosing->locals[local].closure = -1;
         return addUpvalue(compiler, (uint8_t)local, true);
     }
 
-    int upvalue = resolveUpvalue((Compiler*)compiler->enclosing, name);
+    int upvalue = resolveUpvalue(enclosing, name);
     if (upvalue != -1) {
+        enclosing->sharesUpvalues = true;
         return addUpvalue(compiler, (uint8_t)upvalue, false);
     }
 
@@ -381,12 +488,59 @@ static void addLocal(Token name) {
     local->name = name;
     local->depth = -1;
     local->isCaptured = false;
+    local->closure = -1;
+}
+
+// Names of native globals the script defines or assigns somewhere. The
+// global may not hold the native when a call runs, so calls look it up.
+static Table reboundNatives;
+
+// The native a call to global `name` can be bound to, or NULL.
+static ObjNative* resolveNative(Token* name) {
+    if (!compilerOptions.bindNatives) return NULL;
+    Value value;
+    ObjString* string = copyString(name->start, name->length);
+    if (tableGet(&vm.globals, string, &value) && IS_NATIVE(value) &&
+        !tableGet(&reboundNatives, string, &value)) {
+        return AS_NATIVE(value);
+    }
+    return NULL;
+}
+
+// Fills reboundNatives from a scan of the whole source ahead of parsing.
+// Locals and fields that share a native's name are counted too, which only
+// costs their calls the binding.
+static void findReboundNatives(const char* source) {
+    initScanner(source);
+    Token before = {TOKEN_EOF, source, 0, 0};
+    Token previous = before;
+    for (;;) {
+        Token token = scanToken();
+        if (token.type == TOKEN_EOF) break;
+
+        Token* name = NULL;
+        if (token.type == TOKEN_IDENTIFIER &&
+            (previous.type == TOKEN_VAR || previous.type == TOKEN_FUN ||
+             previous.type == TOKEN_CLASS)) {
+            name = &token;
+        } else if (token.type == TOKEN_EQUAL &&
+                   previous.type == TOKEN_IDENTIFIER &&
+                   before.type != TOKEN_DOT) {
+            name = &previous;
+        }
+        if (name != NULL && resolveNative(name) != NULL) {
+            tableSet(&reboundNatives, copyString(name->start, name->length),
+                     BOOL_VAL(true));
+        }
+        before = previous;
+        previous = token;
+    }
 }
 
 static void declareVariable() {
+    Token* name = &parser.previous;
     if (current->scopeDepth == 0) return;
 
-    Token* name = &parser.previous;
     for (int i = current->localCount - 1; i >= 0; i--) {
         Local* local = &current->locals[i];
         if (local->depth != -1 && local->depth < current->scopeDepth) {
@@ -401,7 +555,7 @@ static void declareVariable() {
     addLocal(*name);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
+static int parseVariable(const char* errorMessage) {
     consume(TOKEN_IDENTIFIER, errorMessage);
 
     declareVariable();
@@ -415,12 +569,12 @@ static void markInitialized() {
     current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
     if (current->scopeDepth > 0) {
         markInitialized();
         return;
     }
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitConstantOp(OP_DEFINE_GLOBAL, global);
 }
 
 static void expression();
@@ -440,7 +594,26 @@ static uint8_t argumentList() {
     return argCount;
 }
 
+// With a constant left operand, `and` and `or` evaluate to that operand when
+// its truthiness is `keptIf`, and to the right one otherwise.
+static bool foldLogical(bool keptIf, Precedence precedence) {
+    int left = current->lastConstant;
+    if (left == -1) return false;
+
+    if (!isFalsey(constantAt(left)) == keptIf) {
+        int right = currentChunk()->count;
+        parsePrecedence(precedence);
+        rewindCode(right);
+        current->lastConstant = left;
+    } else {
+        rewindCode(left);
+        parsePrecedence(precedence);
+    }
+    return true;
+}
+
 static void and_(bool canAssign) {
+    if (foldLogical(false, PREC_AND)) return;
     int endJump = emitJump(OP_JUMP_IF_FALSE);
 
     emitByte(OP_POP);
@@ -450,6 +623,7 @@ static void and_(bool canAssign) {
 }
 
 static void or_(bool canAssign) {
+    if (foldLogical(true, PREC_OR)) return;
     int elseJump = emitJump(OP_JUMP_IF_FALSE);
     int endJump = emitJump(OP_JUMP);
 
@@ -463,7 +637,7 @@ static void or_(bool canAssign) {
 static void expression() { parsePrecedence(PREC_ASSIGNMENT); }
 
 static void varDeclaration() {
-    uint8_t global = parseVariable("Expect variable name.");
+    int global = parseVariable("Expect variable name.");
 
     if (match(TOKEN_EQUAL)) {
         expression();
@@ -494,6 +668,12 @@ static void returnStatement() {
         }
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+        // The call is the last thing evaluated on every path that reaches
+        // the return, so its callee can take over this frame.
+        if (current->lastCall >= 0 &&
+            current->lastCall == currentChunk()->count - 2) {
+            currentChunk()->code[current->lastCall] = OP_TAIL_CALL;
+        }
         emitByte(OP_RETURN);
     }
 }
@@ -523,13 +703,47 @@ static void synchronize() {
 
 static void beginScope() { current->scopeDepth++; }
 
+// The local `fun` at `closure` was only ever called directly from this
+// function, so it never outlives the frame: its captures can read our slots
+// through the caller frame instead of going through ObjUpvalues.
+static void keepClosureOnFrame(int closure) {
+    if (parser.hadError) return;
+
+    Chunk* chunk = currentChunk();
+    int constant = 0;
+    if (chunk->code[closure] == OP_WIDE) {
+        constant = (chunk->code[closure + 1] << 16) |
+                   (chunk->code[closure + 2] << 8);
+        closure += 3;
+    }
+    constant |= chunk->code[closure + 1];
+    uint8_t* captures = &chunk->code[closure + 2];
+    ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+    chunk->code[closure] = OP_FRAME_CLOSURE;
+    function->readsEnclosingFrame = function->upvalueCount > 0;
+
+    Chunk* body = (Chunk*)&function->chunk;
+    for (int offset = 0; offset < body->count;
+         offset += instructionLength(body, offset)) {
+        uint8_t* code = &body->code[offset];
+        if (code[0] == OP_GET_UPVALUE || code[0] == OP_SET_UPVALUE) {
+            code[0] = code[0] == OP_GET_UPVALUE ? OP_GET_OUTER_LOCAL
+                                                : OP_SET_OUTER_LOCAL;
+            code[1] = captures[2 * code[1] + 1];
+        }
+    }
+}
+
 static void endScope() {
     current->scopeDepth--;
 
     while (current->localCount > 0 &&
            current->locals[current->localCount - 1].depth >
                current->scopeDepth) {
-        if (current->locals[current->localCount - 1].isCaptured) {
+        Local* local = &current->locals[current->localCount - 1];
+        if (local->closure != -1) keepClosureOnFrame(local->closure);
+
+        if (local->isCaptured) {
             emitByte(OP_CLOSE_UPVALUE);
         } else {
             emitByte(OP_POP);
@@ -544,11 +758,45 @@ static void expressionStatement() {
     emitByte(OP_POP);
 }
 
+// Compiles a statement that can never run, for its errors only.
+static void deadStatement() {
+    int start = currentChunk()->count;
+    statement();
+    rewindCode(start);
+}
+
+// Drops the condition just compiled from `start` on if it is a constant, and
+// returns whether that is known to be truthy or falsey.
+static bool constantCondition(int start, bool* truthy) {
+    if (current->lastConstant != start) return false;
+    *truthy = !isFalsey(constantAt(start));
+    rewindCode(start);
+    return true;
+}
+
 static void ifStatement() {
     consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    int condition = currentChunk()->count;
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
+    bool truthy;
+    if (constantCondition(condition, &truthy)) {
+        if (truthy) {
+            statement();
+        } else {
+            deadStatement();
+        }
+        if (match(TOKEN_ELSE)) {
+            if (truthy) {
+                deadStatement();
+            } else {
+                statement();
+            }
+        }
+        return;
+    }
+
     int thenJump = emitJump(OP_JUMP_IF_FALSE);  // conditional [end of true]
     emitByte(OP_POP);                  // pop the condition before [true]
     statement();                       // [true statement body]
@@ -557,10 +805,6 @@ static void ifStatement() {
     emitByte(OP_POP);     // pop the condition before [false]
 
     if (match(TOKEN_ELSE)) statement();
-
-    if (match(TOKEN_ELSE)) {
-        statement();
-    }
     patchJump(elseJump);  // fix the jump address to code pointer
 }
 
@@ -570,6 +814,17 @@ static void whileStatement() {
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
+    bool truthy;
+    if (constantCondition(loopStart, &truthy)) {
+        if (truthy) {
+            statement();
+            emitLoop(loopStart);
+        } else {
+            deadStatement();
+        }
+        return;
+    }
+
     int exitJump = emitJump(OP_JUMP_IF_FALSE);
     emitByte(OP_POP);
     statement();
@@ -633,7 +888,9 @@ static void block() {
 
 static ObjFunction* endCompiler();
 
-static void function(FunctionType type) {
+// Returns whether the closure reads only locals of the enclosing function, so
+// it could do so through the enclosing frame if it never escapes.
+static bool function(FunctionType type) {
     Compiler compiler;
     initCompiler(&compiler, type);
     beginScope();
@@ -645,7 +902,7 @@ static void function(FunctionType type) {
             if (current->function->arity > 255) {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expect parameter name.");
+            int constant = parseVariable("Expect parameter name.");
             defineVariable(constant);
         } while (match(TOKEN_COMMA));
     }
@@ -654,24 +911,27 @@ static void function(FunctionType type) {
     block();
 
     ObjFunction* function = endCompiler();
-    emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    emitConstantOp(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
 
+    bool readsOnlyLocals = !compiler.sharesUpvalues;
     for (int i = 0; i < function->upvalueCount; i++) {
         emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
         emitByte(compiler.upvalues[i].index);
+        readsOnlyLocals = readsOnlyLocals && compiler.upvalues[i].isLocal;
     }
+    return readsOnlyLocals;
 }
 
 static void method() {
     consume(TOKEN_IDENTIFIER, "Expect method name.");
-    uint8_t constant = identifierConstant(&parser.previous);
+    int constant = identifierConstant(&parser.previous);
     FunctionType type = TYPE_METHOD;
     if (parser.previous.length == 4 &&
         memcmp(parser.previous.start, "init", 4) == 0) {
         type = TYPE_INITIALIZER;
     }
     function(type);
-    emitBytes(OP_METHOD, constant);
+    emitConstantOp(OP_METHOD, constant);
 }
 
 static void namedVariable(Token name, bool canAssign) {
@@ -680,6 +940,8 @@ static void namedVariable(Token name, bool canAssign) {
     if (arg != -1) {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
+        // Anything but a direct call lets a local closure escape.
+        if (!check(TOKEN_LEFT_PAREN)) current->locals[arg].closure = -1;
     } else if ((arg = resolveUpvalue(current, &name)) != -1) {
         getOp = OP_GET_UPVALUE;
         setOp = OP_SET_UPVALUE;
@@ -687,13 +949,23 @@ static void namedVariable(Token name, bool canAssign) {
         arg = identifierConstant(&name);
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
+
+        ObjNative* native = resolveNative(&name);
+        if (native != NULL && check(TOKEN_LEFT_PAREN)) {
+            // Skip the global lookup and let call() bind the call. An
+            // intrinsic is a plain instruction and needs no callee.
+            if (native->intrinsic == -1) emitConstant(OBJ_VAL(native));
+            current->calleeNative = native;
+            current->calleeNativeAt = currentChunk()->count;
+            return;
+        }
     }
 
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(setOp, (uint8_t)arg);
+        emitConstantOp(setOp, arg);
     } else {
-        emitBytes(getOp, (uint8_t)arg);
+        emitConstantOp(getOp, arg);
     }
 }
 
@@ -726,27 +998,27 @@ static void super_(bool canAssign) {
 
     consume(TOKEN_DOT, "Expect '.' after 'super'.");
     consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
 
     namedVariable(syntheticToken("this"), false);
     if (match(TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList();
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_SUPER_INVOKE, name);
+        emitConstantOp(OP_SUPER_INVOKE, name);
         emitByte(argCount);
     } else {
         namedVariable(syntheticToken("super"), false);
-        emitBytes(OP_GET_SUPER, name);
+        emitConstantOp(OP_GET_SUPER, name);
     }
 }
 
 static void classDeclaration() {
     consume(TOKEN_IDENTIFIER, "Expect class name.");
     Token className = parser.previous;
-    uint8_t nameConstant = identifierConstant(&parser.previous);
+    int nameConstant = identifierConstant(&parser.previous);
     declareVariable();
 
-    emitBytes(OP_CLASS, nameConstant);
+    emitConstantOp(OP_CLASS, nameConstant);
     defineVariable(nameConstant);
 
     ClassCompiler classCompiler;
@@ -754,7 +1026,6 @@ static void classDeclaration() {
     classCompiler.enclosing = currentClass;
     currentClass = &classCompiler;
 
-    namedVariable(className, false);
     if (match(TOKEN_LESS)) {
         consume(TOKEN_IDENTIFIER, "Expect superclass name.");
         variable(false);
@@ -771,6 +1042,8 @@ static void classDeclaration() {
         emitByte(OP_INHERIT);
     }
 
+    namedVariable(className, false);
+
     consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
     while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
         method();
@@ -785,9 +1058,14 @@ static void classDeclaration() {
 }
 
 static void funDeclaration() {
-    uint8_t global = parseVariable("Expect function name.");
+    int global = parseVariable("Expect function name.");
     markInitialized();
-    function(TYPE_FUNCTION);
+    int closure = currentChunk()->count;
+    if (function(TYPE_FUNCTION) && current->scopeDepth > 0) {
+        Local* local = &current->locals[current->localCount - 1];
+        // Recursion captures the local itself.
+        if (!local->isCaptured) local->closure = closure;
+    }
     defineVariable(global);
 }
 
@@ -829,12 +1107,12 @@ static void declaration() {
 
 static void number(bool canAssign) {
     double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+    emitConstant(INT_OR_NUMBER_VAL(value));
 }
 
 static void string(bool canAssign) {
-    emitConstant(OBJ_VAL(
-        copyString(parser.previous.start + 1, parser.previous.length - 2)));
+    emitConstant(copyStringValue(parser.previous.start + 1,
+                                 parser.previous.length - 2));
 }
 
 static void grouping(bool canAssign) {
@@ -842,19 +1120,93 @@ static void grouping(bool canAssign) {
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
+// Computes `op` over constant operands the way the VM would. Returns false
+// for anything the VM would reject, which is left to fail at runtime.
+bool foldOperation(OpCode op, Value a, Value b, Value* result) {
+    if (op == OP_NOT) {
+        *result = BOOL_VAL(isFalsey(a));
+        return true;
+    }
+    if (op == OP_EQUAL || op == OP_BANG_EQUAL) {
+        *result = BOOL_VAL(valuesEqual(a, b) == (op == OP_EQUAL));
+        return true;
+    }
+    if (op == OP_NEGATE) {
+        if (!IS_NUMBER(a)) return false;
+        *result = NUMBER_VAL(-AS_NUMBER(a));
+        return true;
+    }
+    if (op == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+        *result = concatenateStrings(a, b);
+        return true;
+    }
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+
+    bool ints = IS_INT(a) && IS_INT(b);
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (op) {
+        case OP_ADD:
+            *result = ints ? intResult((int64_t)AS_INT(a) + AS_INT(b))
+                           : NUMBER_VAL(x + y);
+            break;
+        case OP_SUBTRACT:
+            *result = ints ? intResult((int64_t)AS_INT(a) - AS_INT(b))
+                           : NUMBER_VAL(x - y);
+            break;
+        case OP_MULTIPLY:
+            *result = NUMBER_VAL(x * y);
+            break;
+        case OP_DIVIDE:
+            *result = NUMBER_VAL(x / y);
+            break;
+        case OP_GREATER:
+            *result = BOOL_VAL(x > y);
+            break;
+        case OP_GREATER_EQUAL:
+            *result = BOOL_VAL(x >= y);
+            break;
+        case OP_LESS:
+            *result = BOOL_VAL(x < y);
+            break;
+        case OP_LESS_EQUAL:
+            *result = BOOL_VAL(x <= y);
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+// Emits `op` over operands loaded from `start` on. When those are just the
+// constants `a` and `b`, they are replaced by the constant `op` yields.
+static void emitOperation(OpCode op, int start, bool constant, Value a,
+                          Value b) {
+    Value result;
+    if (constant && foldOperation(op, a, b, &result)) {
+        rewindCode(start);
+        emitConstant(result);
+    } else {
+        emitByte(op);
+    }
+}
+
 static void unary(bool canAssign) {
     TokenType operatorType = parser.previous.type;
 
     // Compile the operand
+    int operand = currentChunk()->count;
     parsePrecedence(PREC_UNARY);
+    bool constant = current->lastConstant == operand;
+    Value value = constant ? constantAt(operand) : NIL_VAL;
 
     // Emit the operator instruction.
     switch (operatorType) {
         case TOKEN_MINUS:
-            emitByte(OP_NEGATE);
+            emitOperation(OP_NEGATE, operand, constant, value, NIL_VAL);
             break;
         case TOKEN_BANG:
-            emitByte(OP_NOT);
+            emitOperation(OP_NOT, operand, constant, value, NIL_VAL);
             break;
         default: {
             printf("Fatal: unreachable unary operator type %d\n", operatorType);
@@ -864,14 +1216,23 @@ static void unary(bool canAssign) {
 }
 
 static ObjFunction* endCompiler() {
+    for (int i = 0; i < current->localCount; i++) {
+        if (current->locals[i].closure != -1) {
+            keepClosureOnFrame(current->locals[i].closure);
+        }
+    }
     emitReturn();
     ObjFunction* function = current->function;
+    freeValueTable(&current->constantIndex);
+    if (compilerOptions.peephole && !parser.hadError) {
+        peepholeChunk(currentChunk());
+    }
 
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
-        disassembleChunk(currentChunk(), function->name != NULL
-                                             ? function->name->chars
-                                             : "<script>");
+        ObjString* name = DEREF(ObjString, function->name);
+        disassembleChunk(currentChunk(),
+                         name != NULL ? name->chars : "<script>");
     }
 #endif
     current = (Compiler*)current->enclosing;
@@ -881,38 +1242,44 @@ static ObjFunction* endCompiler() {
 static void binary(bool canAssign) {
     TokenType operatorType = parser.previous.type;
     ParseRule* rule = getRule(operatorType);
+    // The left operand is a constant if it was the last thing emitted.
+    int left = current->lastConstant;
+    int right = currentChunk()->count;
     parsePrecedence((Precedence)(rule->precedence + 1));
+    bool constant = left != -1 && current->lastConstant == right;
+    Value a = constant ? constantAt(left) : NIL_VAL;
+    Value b = constant ? constantAt(right) : NIL_VAL;
 
     switch (operatorType) {
         case TOKEN_PLUS:
-            emitByte(OP_ADD);
+            emitOperation(OP_ADD, left, constant, a, b);
             break;
         case TOKEN_MINUS:
-            emitByte(OP_SUBTRACT);
+            emitOperation(OP_SUBTRACT, left, constant, a, b);
             break;
         case TOKEN_STAR:
-            emitByte(OP_MULTIPLY);
+            emitOperation(OP_MULTIPLY, left, constant, a, b);
             break;
         case TOKEN_SLASH:
-            emitByte(OP_DIVIDE);
+            emitOperation(OP_DIVIDE, left, constant, a, b);
             break;
         case TOKEN_BANG_EQUAL:
-            emitByte(OP_BANG_EQUAL);
+            emitOperation(OP_BANG_EQUAL, left, constant, a, b);
             break;
         case TOKEN_EQUAL_EQUAL:
-            emitByte(OP_EQUAL);
+            emitOperation(OP_EQUAL, left, constant, a, b);
             break;
         case TOKEN_LESS:
-            emitByte(OP_LESS);
+            emitOperation(OP_LESS, left, constant, a, b);
             break;
         case TOKEN_LESS_EQUAL:
-            emitByte(OP_LESS_EQUAL);
+            emitOperation(OP_LESS_EQUAL, left, constant, a, b);
             break;
         case TOKEN_GREATER:
-            emitByte(OP_GREATER);
+            emitOperation(OP_GREATER, left, constant, a, b);
             break;
         case TOKEN_GREATER_EQUAL:
-            emitByte(OP_GREATER_EQUAL);
+            emitOperation(OP_GREATER_EQUAL, left, constant, a, b);
             break;
         default: {
             printf("Fatal: unreachable binary operator type %d\n",
@@ -923,23 +1290,92 @@ static void binary(bool canAssign) {
 }
 
 static void call(bool canAssign) {
+    ObjNative* native = current->calleeNative;
+    if (native != NULL && current->calleeNativeAt == currentChunk()->count) {
+        current->calleeNative = NULL;
+        uint8_t argCount = argumentList();
+        if (native->arity != NATIVE_VARIADIC && argCount != native->arity) {
+            // Only an error if the call runs, so the VM reports it. An
+            // intrinsic left no callee under the arguments; they are
+            // dropped and the call remade with nils in their place.
+            if (native->intrinsic != -1) {
+                for (int i = 0; i < argCount; i++) emitByte(OP_POP);
+                emitConstant(OBJ_VAL(native));
+                for (int i = 0; i < argCount; i++) emitByte(OP_NIL);
+            }
+            emitBytes(OP_CALL, argCount);
+        } else if (native->intrinsic != -1) {
+            emitByte((uint8_t)native->intrinsic);
+        } else {
+            emitBytes(OP_CALL_NATIVE, argCount);
+        }
+        return;
+    }
+
     uint8_t argCount = argumentList();
+    current->lastCall = currentChunk()->count;
     emitBytes(OP_CALL, argCount);
 }
 
 static void dot(bool canAssign) {
     consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-    uint8_t name = identifierConstant(&parser.previous);
+    int name = identifierConstant(&parser.previous);
 
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
-        emitBytes(OP_SET_PROPERTY, name);
+        emitConstantOp(OP_SET_PROPERTY, name);
     } else if (match(TOKEN_LEFT_PAREN)) {
         uint8_t argCount = argumentList();
-        emitBytes(OP_INVOKE, name);
+        emitConstantOp(OP_INVOKE, name);
         emitByte(argCount);
     } else {
-        emitBytes(OP_GET_PROPERTY, name);
+        emitConstantOp(OP_GET_PROPERTY, name);
+    }
+}
+
+static void list(bool canAssign) {
+    int itemCount = 0;
+    if (!check(TOKEN_RIGHT_BRACKET)) {
+        do {
+            expression();
+            if (itemCount == 255) {
+                error("Can't have more than 255 items in a list literal.");
+            }
+            itemCount++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list items.");
+    emitBytes(OP_BUILD_LIST, (uint8_t)itemCount);
+}
+
+// A `{` that starts a statement opens a block, so map literals only come up
+// inside expressions.
+static void map(bool canAssign) {
+    int entryCount = 0;
+    if (!check(TOKEN_RIGHT_BRACE)) {
+        do {
+            expression();
+            consume(TOKEN_COLON, "Expect ':' after map key.");
+            expression();
+            if (entryCount == 255) {
+                error("Can't have more than 255 entries in a map literal.");
+            }
+            entryCount++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+    emitBytes(OP_BUILD_MAP, (uint8_t)entryCount);
+}
+
+static void subscript(bool canAssign) {
+    expression();
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+    if (canAssign && match(TOKEN_EQUAL)) {
+        expression();
+        emitByte(OP_SET_INDEX);
+    } else {
+        emitByte(OP_GET_INDEX);
     }
 }
 
@@ -947,13 +1383,13 @@ static void literal(bool canAssign) {
     TokenType operatorType = parser.previous.type;
     switch (operatorType) {
         case TOKEN_FALSE:
-            emitByte(OP_FALSE);
+            emitConstant(BOOL_VAL(false));
             break;
         case TOKEN_NIL:
-            emitByte(OP_NIL);
+            emitConstant(NIL_VAL);
             break;
         case TOKEN_TRUE:
-            emitByte(OP_TRUE);
+            emitConstant(BOOL_VAL(true));
             break;
         default: {
             printf("Fatal: unreachable literal type %d\n", operatorType);
@@ -963,6 +1399,8 @@ static void literal(bool canAssign) {
 }
 
 ObjFunction* compile(const char* source) {
+    initTable(&reboundNatives);
+    findReboundNatives(source);
     initScanner(source);
     Compiler compiler;
     initCompiler(&compiler, TYPE_SCRIPT);
@@ -974,7 +1412,15 @@ ObjFunction* compile(const char* source) {
     }
 
     ObjFunction* function = endCompiler();
-    return parser.hadError ? NULL : function;
+    freeTable(&reboundNatives);
+    if (parser.hadError) return NULL;
+
+    if (compilerOptions.optimize) {
+        push(OBJ_VAL(function));
+        optimizeProgram(function);
+        pop();
+    }
+    return function;
 }
 
 void markCompilerRoots() {
@@ -3,7 +3,23 @@
 
 #include "chunk.h"
 
+typedef struct {
+    // Run the peephole pass over each finished chunk.
+    bool peephole;
+    // Run the IR passes over the whole program once it is compiled.
+    bool optimize;
+    // Report each call the IR passes inline, on stderr.
+    bool printInlining;
+    // Bind calls to native globals the script never redefines or assigns.
+    bool bindNatives;
+} CompilerOptions;
+
+extern CompilerOptions compilerOptions;
+
 ObjFunction* compile(const char* source);
+// Works out what `op` yields for constant operands the way the VM would,
+// ignoring `b` for unary operators. Returns false where it would be an error.
+bool foldOperation(OpCode op, Value a, Value b, Value* result);
 void markCompilerRoots();
 
 #endif
\ No newline at end of file
@@ -5,8 +5,23 @@
 
 #include "value.h"
 
+// Upper bits of the next constant operand, set by OP_WIDE.
+static int wideHigh = 0;
+
+static int readConstant(const Chunk *chunk, int offset) {
+    int constant = wideHigh | chunk->code[offset];
+    wideHigh = 0;
+    return constant;
+}
+
+static int wideInstruction(const Chunk *chunk, int offset) {
+    wideHigh = (chunk->code[offset + 1] << 16) | (chunk->code[offset + 2] << 8);
+    printf("%-16s %4d\n", "OP_WIDE", wideHigh);
+    return offset + 3;
+}
+
 int constantInstruction(const char *name, const Chunk *chunk, int offset) {
-    uint8_t constantOffset = chunk->code[offset + 1];
+    int constantOffset = readConstant(chunk, offset + 1);
     printf("%-16s %4d '", name, constantOffset);
     printValue(chunk->constants.values[constantOffset]);
     printf("'\n");
@@ -14,7 +29,7 @@ int constantInstruction(const char *name, const Chunk *chunk, int offset) {
 }
 
 static int invokeInstruction(const char *name, const Chunk *chunk, int offset) {
-    uint8_t constant = chunk->code[offset + 1];
+    int constant = readConstant(chunk, offset + 1);
     uint8_t argCount = chunk->code[offset + 2];
     printf("%-16s (%d args) %4d '", name, argCount, constant);
     printValue(chunk->constants.values[constant]);
@@ -41,6 +56,84 @@ static int jumpInstruction(const char *name, int sign, const Chunk *chunk,
     return offset + 3;
 }
 
+static int closureInstruction(const char *name, const Chunk *chunk,
+                              int offset) {
+    offset++;
+    int constant = readConstant(chunk, offset++);
+    printf("%-16s %4d ", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("\n");
+
+    ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+    for (int j = 0; j < function->upvalueCount; j++) {
+        int isLocal = chunk->code[offset++];
+        int index = chunk->code[offset++];
+        printf("%04d      |                     %s %d\n",  //
+               offset - 2,                                 //
+               isLocal == 1 ? "local" : "upvalue",         //
+               index);
+    }
+    return offset;
+}
+
+static const char *opcodeNames[] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_WIDE] = "OP_WIDE",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_POP] = "OP_POP",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_GET_OUTER_LOCAL] = "OP_GET_OUTER_LOCAL",
+    [OP_SET_OUTER_LOCAL] = "OP_SET_OUTER_LOCAL",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+    [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+    [OP_GET_SUPER] = "OP_GET_SUPER",
+    [OP_BUILD_LIST] = "OP_BUILD_LIST",
+    [OP_BUILD_MAP] = "OP_BUILD_MAP",
+    [OP_GET_INDEX] = "OP_GET_INDEX",
+    [OP_SET_INDEX] = "OP_SET_INDEX",
+    [OP_LIST_APPEND] = "OP_LIST_APPEND",
+    [OP_LENGTH] = "OP_LENGTH",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_BANG_EQUAL] = "OP_BANG_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_GREATER_EQUAL] = "OP_GREATER_EQUAL",
+    [OP_LESS] = "OP_LESS",
+    [OP_LESS_EQUAL] = "OP_LESS_EQUAL",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_JUMP_IF_TRUE] = "OP_JUMP_IF_TRUE",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_CALL] = "OP_CALL",
+    [OP_TAIL_CALL] = "OP_TAIL_CALL",
+    [OP_CALL_NATIVE] = "OP_CALL_NATIVE",
+    [OP_INVOKE] = "OP_INVOKE",
+    [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_FRAME_CLOSURE] = "OP_FRAME_CLOSURE",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_CLASS] = "OP_CLASS",
+    [OP_INHERIT] = "OP_INHERIT",
+    [OP_METHOD] = "OP_METHOD",
+    [OP_RETURN] = "OP_RETURN",
+};
+
+const char *opcodeName(OpCode op) { return opcodeNames[op]; }
+
 void disassembleChunk(const Chunk *chunk, const char *name) {
     printf("== %s ==\n", name);
 
@@ -63,6 +156,8 @@ int disassembleInstruction(const Chunk *chunk, int offset) {
     switch (instruction) {
         case OP_CONSTANT:
             return constantInstruction("OP_CONSTANT", chunk, offset);
+        case OP_WIDE:
+            return wideInstruction(chunk, offset);
             break;
 
         case OP_NIL:
@@ -102,6 +197,12 @@ int disassembleInstruction(const Chunk *chunk, int offset) {
         case OP_SET_UPVALUE:
             return byteInstruction("OP_SET_UPVALUE", chunk, offset);
 
+        case OP_GET_OUTER_LOCAL:
+            return byteInstruction("OP_GET_OUTER_LOCAL", chunk, offset);
+
+        case OP_SET_OUTER_LOCAL:
+            return byteInstruction("OP_SET_OUTER_LOCAL", chunk, offset);
+
         case OP_GET_PROPERTY:
             return constantInstruction("OP_GET_PROPERTY", chunk, offset);
 
@@ -110,6 +211,18 @@ int disassembleInstruction(const Chunk *chunk, int offset) {
 
         case OP_GET_SUPER:
             return constantInstruction("OP_GET_SUPER", chunk, offset);
+        case OP_BUILD_LIST:
+            return byteInstruction("OP_BUILD_LIST", chunk, offset);
+        case OP_BUILD_MAP:
+            return byteInstruction("OP_BUILD_MAP", chunk, offset);
+        case OP_GET_INDEX:
+            return simpleInstruction("OP_GET_INDEX", offset);
+        case OP_SET_INDEX:
+            return simpleInstruction("OP_SET_INDEX", offset);
+        case OP_LIST_APPEND:
+            return simpleInstruction("OP_LIST_APPEND", offset);
+        case OP_LENGTH:
+            return simpleInstruction("OP_LENGTH", offset);
 
         case OP_EQUAL:
             return simpleInstruction("OP_EQUAL", offset);
@@ -171,6 +284,10 @@ int disassembleInstruction(const Chunk *chunk, int offset) {
             return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
             break;
 
+        case OP_JUMP_IF_TRUE:
+            return jumpInstruction("OP_JUMP_IF_TRUE", 1, chunk, offset);
+            break;
+
         case OP_LOOP: {
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
             break;
@@ -179,32 +296,22 @@ int disassembleInstruction(const Chunk *chunk, int offset) {
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
 
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
+        case OP_CALL_NATIVE:
+            return byteInstruction("OP_CALL_NATIVE", chunk, offset);
+
         case OP_INVOKE:
             return invokeInstruction("OP_INVOKE", chunk, offset);
 
         case OP_SUPER_INVOKE:
             return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
 
-        case OP_CLOSURE: {
-            offset++;
-            uint8_t constant = chunk->code[offset++];
-            printf("%-16s %4d ", "OP_CLOSURE", constant);
-            printValue(chunk->constants.values[constant]);
-            printf("\n");
-
-            ObjFunction *function =
-                AS_FUNCTION(chunk->constants.values[constant]);
-            for (int j = 0; j < function->upvalueCount; j++) {
-                int isLocal = chunk->code[offset++];
-                int index = chunk->code[offset++];
-                printf("%04d      |                     %s %d\n",  //
-                       offset - 2,                                 //
-                       isLocal == 1 ? "local" : "upvalue",         //
-                       index);
-
-                return offset;
-            }
-        }
+        case OP_CLOSURE:
+            return closureInstruction("OP_CLOSURE", chunk, offset);
+
+        case OP_FRAME_CLOSURE:
+            return closureInstruction("OP_FRAME_CLOSURE", chunk, offset);
 
         case OP_CLOSE_UPVALUE:
             return simpleInstruction("OP_CLOSE_UPVALUE", offset);
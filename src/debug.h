@@ -6,5 +6,6 @@
 void disassembleChunk(const Chunk *chunk, const char *name);
 
 int disassembleInstruction(const Chunk *chunk, int offset);
+const char *opcodeName(OpCode op);
 
 #endif
\ No newline at end of file
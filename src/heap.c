@@ -0,0 +1,220 @@
+// mmap() flags are outside of strict C99.
+#define _DEFAULT_SOURCE
+
+#include "heap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "value.h"
+
+typedef struct {
+    Obj obj;
+    size_t next;
+} FreeBlock;
+
+// Every block must be able to hold a FreeBlock once it is freed.
+#define HEAP_MIN_UNITS \
+    ((sizeof(FreeBlock) + HEAP_ALIGNMENT - 1) / HEAP_ALIGNMENT)
+
+Heap heap;
+
+void initHeap() {
+    // Only address space is reserved; commit() makes pages usable as the
+    // heap grows into them. Under an address space limit, half of it is
+    // left to the rest of the process.
+    size_t size = HEAP_RESERVE;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_AS, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY &&
+        limit.rlim_cur / 2 < size) {
+        size = (size_t)(limit.rlim_cur / 2);
+    }
+    size -= size % HEAP_COMMIT_STEP;
+
+    void *base = MAP_FAILED;
+    for (; size >= HEAP_RESERVE_MIN; size /= 2) {
+        base = mmap(NULL, size, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base != MAP_FAILED) break;
+    }
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "heap: cannot reserve %zu bytes\n",
+                (size_t)HEAP_RESERVE_MIN);
+        exit(1);
+    }
+
+    heap.base = (char *)base;
+    heap.reserved = size;
+    heap.committed = 0;
+    heap.top = HEAP_ALIGNMENT;  // keep ref 0 for NULL.
+    heap.pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+        heap.freeLists[i] = 0;
+    }
+    heap.largeFree = 0;
+}
+
+void freeHeap() {
+    munmap(heap.base, heap.reserved);
+    heap.base = NULL;
+}
+
+static size_t roundUp(size_t offset, size_t step) {
+    return (offset + step - 1) / step * step;
+}
+
+// Makes the region usable up to `end`. False when the system won't.
+static bool commit(size_t end) {
+    if (end <= heap.committed) return true;
+    size_t target = roundUp(end, HEAP_COMMIT_STEP);
+    if (target > heap.reserved) target = heap.reserved;
+    if (mprotect(heap.base + heap.committed, target - heap.committed,
+                 PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+    heap.committed = target;
+    return true;
+}
+
+// Hands back the pages past the bump allocator. One step more than needed
+// is kept, so a heap hovering at a boundary doesn't map and unmap each time.
+static void decommit() {
+    size_t keep = roundUp(heap.top, HEAP_COMMIT_STEP) + HEAP_COMMIT_STEP;
+    if (keep >= heap.committed) return;
+    // Mapping fresh inaccessible pages over them drops their contents.
+    void *tail = mmap(heap.base + keep, heap.committed - keep, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+                      -1, 0);
+    if (tail != MAP_FAILED) heap.committed = keep;
+}
+
+static Obj *blockAt(size_t offset) { return (Obj *)(heap.base + offset); }
+
+static size_t offsetOf(const void *block) {
+    return (size_t)((const char *)block - heap.base);
+}
+
+static void linkFreeBlock(void *start, size_t units) {
+    FreeBlock *block = (FreeBlock *)start;
+    block->obj.type = HEAP_FREE_BLOCK;
+    block->obj.units = (uint32_t)units;
+    if (units < HEAP_SIZE_CLASSES) {
+        block->next = heap.freeLists[units];
+        heap.freeLists[units] = offsetOf(block);
+    } else {
+        block->next = heap.largeFree;
+        heap.largeFree = offsetOf(block);
+    }
+}
+
+static Obj *takeLargeBlock(size_t units) {
+    size_t *link = &heap.largeFree;
+    while (*link != 0) {
+        FreeBlock *block = (FreeBlock *)blockAt(*link);
+        if (block->obj.units >= units) {
+            *link = block->next;
+            size_t rest = block->obj.units - units;
+            if (rest >= HEAP_MIN_UNITS) {
+                linkFreeBlock((char *)block + units * HEAP_ALIGNMENT, rest);
+                block->obj.units = (uint32_t)units;
+            }
+            return &block->obj;
+        }
+        link = &block->next;
+    }
+    return NULL;
+}
+
+void *heapAllocate(size_t size) {
+    size_t units = (size + HEAP_ALIGNMENT - 1) / HEAP_ALIGNMENT;
+    if (units < HEAP_MIN_UNITS) units = HEAP_MIN_UNITS;
+    if (units > UINT32_MAX) return NULL;
+
+    if (units < HEAP_SIZE_CLASSES && heap.freeLists[units] != 0) {
+        FreeBlock *block = (FreeBlock *)blockAt(heap.freeLists[units]);
+        heap.freeLists[units] = block->next;
+        return block;
+    }
+
+    Obj *block = takeLargeBlock(units);
+    if (block != NULL) return block;
+
+    size_t bytes = units * HEAP_ALIGNMENT;
+    if (bytes > heap.reserved - heap.top || !commit(heap.top + bytes)) {
+        return NULL;
+    }
+    block = blockAt(heap.top);
+    block->units = (uint32_t)units;
+    heap.top += bytes;
+    return block;
+}
+
+void heapFree(void *pointer) {
+    Obj *block = (Obj *)pointer;
+    block->type = HEAP_FREE_BLOCK;
+#ifdef DEBUG_STRESS_GC
+    // Make stale references to the object fail loudly.
+    memset(block + 1, 0xdb, block->units * HEAP_ALIGNMENT - sizeof(Obj));
+#endif
+
+    // The most recent allocation goes straight back to the bump allocator.
+    size_t end = (size_t)((char *)block - heap.base) +
+                 (size_t)block->units * HEAP_ALIGNMENT;
+    if (end == heap.top) {
+        heap.top -= (size_t)block->units * HEAP_ALIGNMENT;
+    }
+}
+
+// Links the free run [start, end) and gives the whole pages inside it back
+// to the system; they read as zeros when next touched.
+static void linkFreeRun(size_t start, size_t end) {
+    // A block's size has to fit in Obj::units.
+    size_t maxBytes = (size_t)UINT32_MAX * HEAP_ALIGNMENT;
+    for (size_t block = start; block < end;) {
+        size_t bytes = end - block;
+        // Leave the remainder big enough to be a block itself.
+        if (bytes > maxBytes) {
+            bytes = maxBytes - HEAP_MIN_UNITS * HEAP_ALIGNMENT;
+        }
+        linkFreeBlock(blockAt(block), bytes / HEAP_ALIGNMENT);
+        block += bytes;
+    }
+
+    size_t from = roundUp(start + sizeof(FreeBlock), heap.pageSize);
+    size_t to = end / heap.pageSize * heap.pageSize;
+    if (to > from && to - from >= HEAP_RELEASE_MIN) {
+        madvise(heap.base + from, to - from, MADV_DONTNEED);
+    }
+}
+
+void sweepHeap(void (*sweepObject)(Obj *object)) {
+    for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+        heap.freeLists[i] = 0;
+    }
+    heap.largeFree = 0;
+
+    // Start of the current run of free blocks; 0 when not in one.
+    size_t run = 0;
+    size_t offset = HEAP_ALIGNMENT;
+    while (offset < heap.top) {
+        Obj *block = blockAt(offset);
+        size_t units = block->units;
+        if (block->type != HEAP_FREE_BLOCK) sweepObject(block);
+
+        if (block->type == HEAP_FREE_BLOCK) {
+            if (run == 0) run = offset;
+        } else if (run != 0) {
+            linkFreeRun(run, offset);
+            run = 0;
+        }
+        offset += units * HEAP_ALIGNMENT;
+    }
+
+    // Trailing free space goes back to the bump allocator.
+    if (run != 0) heap.top = run;
+    decommit();
+}
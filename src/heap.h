@@ -0,0 +1,74 @@
+#ifndef clox_heap_h
+#define clox_heap_h
+
+#include "common.h"
+
+// All objects live in one reserved virtual region. Every block in it starts
+// with the 8 byte Obj header, which records the block size, so the collector
+// enumerates objects by walking the region. An object reference also fits in
+// 32 bits: the offset from the region base in HEAP_ALIGNMENT units. That
+// addresses up to 32 GB; offset 0 is never handed out and stands for NULL.
+#define HEAP_ALIGNMENT 8
+// The most address space the region takes. initHeap() settles for less,
+// down to HEAP_RESERVE_MIN, where the process can't have that much.
+#ifndef HEAP_RESERVE
+#ifdef COMPRESSED_REFS
+#define HEAP_RESERVE ((size_t)4 << 30)
+#else
+#define HEAP_RESERVE ((size_t)256 << 30)
+#endif
+#endif
+#define HEAP_RESERVE_MIN ((size_t)16 << 20)
+// Pages are made usable, and handed back, this many bytes at a time.
+#define HEAP_COMMIT_STEP ((size_t)1 << 20)
+// Free runs at least this long give their inner pages back to the system.
+#define HEAP_RELEASE_MIN ((size_t)64 << 10)
+// Obj::type of a block that holds no object.
+#define HEAP_FREE_BLOCK 0xff
+// Free blocks below this many HEAP_ALIGNMENT units get an exact free list.
+#define HEAP_SIZE_CLASSES 64
+
+typedef uint32_t ObjRef;
+
+typedef struct {
+    char *base;
+    size_t reserved;
+    // Bytes from base that are readable and writable; the rest of the
+    // region can't be touched.
+    size_t committed;
+    // End of the bump allocated part of the region.
+    size_t top;
+    size_t pageSize;
+    // Free lists hold byte offsets from base, 0 ending the list.
+    size_t freeLists[HEAP_SIZE_CLASSES];
+    // Bigger free blocks, first fit.
+    size_t largeFree;
+} Heap;
+
+extern Heap heap;
+
+struct Obj;
+
+void initHeap();
+void freeHeap();
+// Returns a block with the header's size filled in, or NULL once the region
+// or the system is out of memory.
+void *heapAllocate(size_t size);
+// The block is reused once a sweep has relinked it.
+void heapFree(void *pointer);
+// Calls sweepObject() on every object, which either keeps it or frees it
+// through heapFree(). Adjacent free blocks are then merged into free lists,
+// and pages no block needs go back to the system.
+void sweepHeap(void (*sweepObject)(struct Obj *object));
+
+static inline ObjRef heapRef(const void *pointer) {
+    if (pointer == NULL) return 0;
+    return (ObjRef)(((const char *)pointer - heap.base) / HEAP_ALIGNMENT);
+}
+
+static inline void *heapDeref(ObjRef ref) {
+    if (ref == 0) return NULL;
+    return heap.base + (size_t)ref * HEAP_ALIGNMENT;
+}
+
+#endif
@@ -0,0 +1,794 @@
+#include "ir.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "debug.h"
+#include "memory.h"
+
+static bool isJump(int op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE ||
+           op == OP_LOOP;
+}
+
+static bool endsBlock(int op) { return isJump(op) || op == OP_RETURN; }
+
+static bool hasConstantOperand(int op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_CLOSURE:
+        case OP_FRAME_CLOSURE:
+        case OP_CLASS:
+        case OP_METHOD:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool hasByteOperand(int op) {
+    switch (op) {
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_OUTER_LOCAL:
+        case OP_SET_OUTER_LOCAL:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_BUILD_LIST:
+        case OP_BUILD_MAP:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CALL_NATIVE:
+            return true;
+        default:
+            return hasConstantOperand(op);
+    }
+}
+
+// How many values `instruction` reads off the top of the stack and how many
+// of those it pops. Returns whether it pushes one.
+static bool stackEffect(const IrInstruction *instruction, int *reads,
+                        int *pops) {
+    *reads = 0;
+    *pops = 0;
+    switch (instruction->op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_GET_OUTER_LOCAL:
+        case OP_GET_LOCAL:
+        case OP_CLOSURE:
+        case OP_FRAME_CLOSURE:
+        case OP_CLASS:
+            return true;
+
+        case OP_JUMP:
+        case OP_LOOP:
+            return false;
+
+        // These leave the value they read where it was.
+        case OP_SET_GLOBAL:
+        case OP_SET_UPVALUE:
+        case OP_SET_OUTER_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+            *reads = 1;
+            return false;
+
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+            *reads = *pops = 1;
+            return false;
+
+        // The class stays below for the next method, or as `super`.
+        case OP_METHOD:
+        case OP_INHERIT:
+            *reads = 2;
+            *pops = 1;
+            return false;
+
+        case OP_GET_PROPERTY:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_LENGTH:
+            *reads = *pops = 1;
+            return true;
+
+        case OP_SET_INDEX:
+            *reads = *pops = 3;
+            return true;
+        case OP_BUILD_LIST:
+            *reads = *pops = instruction->operand;
+            return true;
+        case OP_BUILD_MAP:
+            *reads = *pops = 2 * instruction->operand;
+            return true;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CALL_NATIVE:
+            *reads = *pops = instruction->operand + 1;
+            return true;
+        case OP_INVOKE:
+            *reads = *pops = instruction->argCount + 1;
+            return true;
+        case OP_SUPER_INVOKE:
+            *reads = *pops = instruction->argCount + 2;
+            return true;
+
+        default:
+            // Property stores, super lookups, indexing, appends and the
+            // binary operators.
+            *reads = *pops = 2;
+            return true;
+    }
+}
+
+static int upvalueCount(const IrFunction *ir, int constant) {
+    Value function = ir->function->chunk.constants.values[constant];
+    return AS_FUNCTION(function)->upvalueCount;
+}
+
+static void decode(IrFunction *ir) {
+    Chunk *chunk = &ir->function->chunk;
+    int *indexAt = ALLOCATE(int, chunk->count + 1);
+    int *lineAt = ALLOCATE(int, chunk->count);
+    getLines(&chunk->lines, lineAt, chunk->count);
+
+    ir->count = 0;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        indexAt[offset] = ir->count++;
+    }
+    indexAt[chunk->count] = ir->count;
+
+    ir->code = ALLOCATE(IrInstruction, ir->count);
+    int run = 0;
+    int frame = -1;
+    for (int offset = 0, i = 0; i < ir->count; i++) {
+        IrInstruction *instruction = &ir->code[i];
+        const uint8_t *code = &chunk->code[offset];
+        int high = 0;
+        if (code[0] == OP_WIDE) {
+            high = (code[1] << 16) | (code[2] << 8);
+            code += 3;
+        }
+
+        instruction->op = code[0];
+        instruction->operand = hasByteOperand(code[0]) ? high | code[1] : 0;
+        instruction->argCount = code[0] == OP_INVOKE ||
+                                        code[0] == OP_SUPER_INVOKE
+                                    ? code[2]
+                                    : 0;
+        while (run < chunk->inlineRunCount &&
+               chunk->inlineRuns[run].start <= offset) {
+            frame = chunk->inlineRuns[run++].frame;
+        }
+        instruction->line = lineAt[offset];
+        instruction->frame = frame;
+        instruction->target = -1;
+        instruction->captures = code[0] == OP_CLOSURE ||
+                                        code[0] == OP_FRAME_CLOSURE
+                                    ? &code[2]
+                                    : NULL;
+        instruction->inputs = 0;
+        instruction->inputCount = 0;
+        instruction->pops = 0;
+        instruction->output = -1;
+        instruction->depth = 0;
+        instruction->replacement = 0;
+        instruction->replacementCount = 0;
+        instruction->prefix = 0;
+        instruction->prefixCount = 0;
+        instruction->removed = false;
+        if (isJump(code[0])) {
+            int jump = (code[1] << 8) | code[2];
+            int to = code[0] == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+            instruction->target = indexAt[to];
+        }
+        offset += instructionLength(chunk, offset);
+    }
+
+    FREE_ARRAY(int, lineAt, chunk->count);
+    FREE_ARRAY(int, indexAt, chunk->count + 1);
+}
+
+// Splits the code at jumps, returns and jump targets, and links the blocks.
+static void findBlocks(IrFunction *ir) {
+    bool *leader = ALLOCATE(bool, ir->count + 1);
+    memset(leader, 0, sizeof(bool) * (ir->count + 1));
+    leader[0] = true;
+    for (int i = 0; i < ir->count; i++) {
+        IrInstruction *instruction = &ir->code[i];
+        if (instruction->target != -1) leader[instruction->target] = true;
+        if (endsBlock(instruction->op)) leader[i + 1] = true;
+    }
+
+    ir->blockCount = 0;
+    for (int i = 0; i < ir->count; i++) {
+        if (leader[i]) ir->blockCount++;
+    }
+    ir->blocks = ALLOCATE(IrBlock, ir->blockCount);
+    int *blockAt = ALLOCATE(int, ir->count + 1);
+    for (int i = 0, block = -1; i < ir->count; i++) {
+        if (leader[i]) {
+            ir->blocks[++block].start = i;
+            if (block > 0) ir->blocks[block - 1].end = i;
+        }
+        blockAt[i] = block;
+    }
+    ir->blocks[ir->blockCount - 1].end = ir->count;
+
+    int edgeCount = 0;
+    for (int b = 0; b < ir->blockCount; b++) {
+        IrBlock *block = &ir->blocks[b];
+        block->successorCount = 0;
+        block->predecessorCount = 0;
+        IrInstruction *last = &ir->code[block->end - 1];
+        if (last->target != -1) last->target = blockAt[last->target];
+
+        if (last->op != OP_RETURN && last->op != OP_JUMP &&
+            last->op != OP_LOOP && b + 1 < ir->blockCount) {
+            block->successors[block->successorCount++] = b + 1;
+        }
+        if (last->target != -1) {
+            block->successors[block->successorCount++] = last->target;
+        }
+        edgeCount += block->successorCount;
+    }
+
+    ir->edges = ALLOCATE(int, edgeCount);
+    ir->edgeCount = edgeCount;
+    for (int b = 0; b < ir->blockCount; b++) {
+        IrBlock *block = &ir->blocks[b];
+        for (int i = 0; i < block->successorCount; i++) {
+            ir->blocks[block->successors[i]].predecessorCount++;
+        }
+    }
+    for (int b = 0, edge = 0; b < ir->blockCount; b++) {
+        ir->blocks[b].predecessors = edge;
+        edge += ir->blocks[b].predecessorCount;
+        ir->blocks[b].predecessorCount = 0;
+    }
+    for (int b = 0; b < ir->blockCount; b++) {
+        IrBlock *block = &ir->blocks[b];
+        for (int i = 0; i < block->successorCount; i++) {
+            IrBlock *successor = &ir->blocks[block->successors[i]];
+            ir->edges[successor->predecessors + successor->predecessorCount++] =
+                b;
+        }
+    }
+
+    FREE_ARRAY(int, blockAt, ir->count + 1);
+    FREE_ARRAY(bool, leader, ir->count + 1);
+}
+
+static int addValue(IrFunction *ir, int def, int block) {
+    if (ir->valueCount == ir->valueCapacity) {
+        int oldCapacity = ir->valueCapacity;
+        ir->valueCapacity = GROW_CAPACITY(oldCapacity);
+        ir->values = GROW_ARRAY(IrValue, ir->values, oldCapacity,
+                                ir->valueCapacity);
+    }
+    IrValue *value = &ir->values[ir->valueCount];
+    value->def = def;
+    value->block = block;
+    value->uses = 0;
+    value->copyOf = -1;
+    return ir->valueCount++;
+}
+
+// Reserves `count` ints at the end of a pool, returning where they start.
+static int reserve(int **pool, int *count, int *capacity, int more) {
+    if (*count + more > *capacity) {
+        int oldCapacity = *capacity;
+        while (*capacity < *count + more) {
+            *capacity = GROW_CAPACITY(*capacity);
+        }
+        *pool = GROW_ARRAY(int, *pool, oldCapacity, *capacity);
+    }
+    int start = *count;
+    *count += more;
+    return start;
+}
+
+static void markCaptures(IrFunction *ir) {
+    memset(ir->captured, 0, sizeof(ir->captured));
+    for (int i = 0; i < ir->count; i++) {
+        IrInstruction *instruction = &ir->code[i];
+        if (instruction->captures == NULL) continue;
+        int count = upvalueCount(ir, instruction->operand);
+        for (int j = 0; j < count; j++) {
+            if (instruction->captures[2 * j] == 1) {
+                ir->captured[instruction->captures[2 * j + 1]] = true;
+            }
+        }
+    }
+}
+
+// Ranks the blocks reachable from the entry in reverse postorder, so each
+// comes after every block leading to it except through a loop's back edge.
+static void orderBlocks(IrFunction *ir) {
+    int *stack = ALLOCATE(int, ir->blockCount);
+    int *next = ALLOCATE(int, ir->blockCount);
+    ir->order = ALLOCATE(int, ir->blockCount);
+    for (int b = 0; b < ir->blockCount; b++) {
+        ir->blocks[b].rank = -1;
+        ir->blocks[b].depth = -1;
+        ir->blocks[b].params = -1;
+        next[b] = 0;
+    }
+
+    // Postorder first, filled in from the back.
+    int count = 0;
+    int top = 0;
+    stack[top++] = 0;
+    ir->blocks[0].rank = 0;
+    while (top > 0) {
+        IrBlock *block = &ir->blocks[stack[top - 1]];
+        if (next[stack[top - 1]] < block->successorCount) {
+            int successor = block->successors[next[stack[top - 1]]++];
+            if (ir->blocks[successor].rank == -1) {
+                ir->blocks[successor].rank = 0;
+                stack[top++] = successor;
+            }
+            continue;
+        }
+        ir->order[ir->blockCount - 1 - count++] = stack[--top];
+    }
+
+    ir->orderCount = count;
+    memmove(ir->order, &ir->order[ir->blockCount - count],
+            sizeof(int) * count);
+    for (int i = 0; i < count; i++) ir->blocks[ir->order[i]].rank = i;
+
+    FREE_ARRAY(int, next, ir->blockCount);
+    FREE_ARRAY(int, stack, ir->blockCount);
+}
+
+bool irIsBackEdge(const IrFunction *ir, int from, int to) {
+    return ir->blocks[from].rank >= ir->blocks[to].rank;
+}
+
+// Sets up the stack `block` starts with. Returns false if its predecessors
+// disagree on how deep it is.
+static bool enterBlock(IrFunction *ir, int b) {
+    IrBlock *block = &ir->blocks[b];
+    int from = -1;
+    int reaching = 0;
+    bool loops = false;
+    for (int i = 0; i < block->predecessorCount; i++) {
+        int predecessor = ir->edges[block->predecessors + i];
+        if (ir->blocks[predecessor].rank == -1) continue;
+        reaching++;
+        if (irIsBackEdge(ir, predecessor, b)) {
+            loops = true;
+            continue;
+        }
+        if (from != -1 &&
+            ir->blocks[from].exitDepth != ir->blocks[predecessor].exitDepth) {
+            return false;
+        }
+        from = predecessor;
+    }
+
+    if (b == 0) {
+        block->depth = ir->function->arity + 1;
+    } else if (from == -1) {
+        // Only a loop leads here, which the entry can't be getting into.
+        return false;
+    } else if (reaching == 1 && !loops) {
+        block->depth = ir->blocks[from].exitDepth;
+        block->entry = ir->blocks[from].exit;
+        return true;
+    } else {
+        block->depth = ir->blocks[from].exitDepth;
+    }
+
+    block->entry = reserve(&ir->stacks, &ir->stackCount, &ir->stackCapacity,
+                           block->depth);
+    for (int i = 0; i < block->depth; i++) {
+        int param = addValue(ir, -1, b);
+        if (i == 0) block->params = param;
+        ir->stacks[block->entry + i] = param;
+    }
+    return true;
+}
+
+// Runs the block's instructions over its entry stack, numbering the values
+// they push and recording the ones they read.
+static bool followBlock(IrFunction *ir, int b, int **stack, int *capacity) {
+    IrBlock *block = &ir->blocks[b];
+    int depth = block->depth;
+    if (depth > *capacity) {
+        int oldCapacity = *capacity;
+        while (*capacity < depth) *capacity = GROW_CAPACITY(*capacity);
+        *stack = GROW_ARRAY(int, *stack, oldCapacity, *capacity);
+    }
+    memcpy(*stack, &ir->stacks[block->entry], sizeof(int) * depth);
+
+    for (int i = block->start; i < block->end; i++) {
+        IrInstruction *instruction = &ir->code[i];
+        int reads;
+        bool pushes = stackEffect(instruction, &reads, &instruction->pops);
+        if (reads > depth) return false;
+        instruction->depth = depth;
+
+        instruction->inputCount = reads;
+        instruction->inputs = reserve(&ir->inputs, &ir->inputCount,
+                                      &ir->inputCapacity, reads);
+        for (int j = 0; j < reads; j++) {
+            int value = (*stack)[depth - reads + j];
+            ir->inputs[instruction->inputs + j] = value;
+            ir->values[value].uses++;
+        }
+        depth -= instruction->pops;
+
+        int op = instruction->op;
+        int slot = instruction->operand;
+        if ((op == OP_GET_LOCAL || op == OP_SET_LOCAL) && slot >= depth) {
+            return false;
+        }
+        if (op == OP_SET_LOCAL) (*stack)[slot] = (*stack)[depth - 1];
+        if (instruction->captures != NULL) {
+            int count = upvalueCount(ir, instruction->operand);
+            for (int j = 0; j < count; j++) {
+                int index = instruction->captures[2 * j + 1];
+                if (instruction->captures[2 * j] != 1) continue;
+                if (index >= depth) return false;
+                ir->values[(*stack)[index]].uses++;
+            }
+        }
+
+        if (pushes) {
+            int output = addValue(ir, i, b);
+            instruction->output = output;
+            if (op == OP_GET_LOCAL) {
+                ir->values[(*stack)[slot]].uses++;
+                if (!ir->captured[slot]) {
+                    ir->values[output].copyOf = (*stack)[slot];
+                }
+            }
+            if (depth == *capacity) {
+                int oldCapacity = *capacity;
+                *capacity = GROW_CAPACITY(oldCapacity);
+                *stack = GROW_ARRAY(int, *stack, oldCapacity, *capacity);
+            }
+            (*stack)[depth++] = output;
+        }
+    }
+
+    block->exitDepth = depth;
+    block->exit = reserve(&ir->stacks, &ir->stackCount, &ir->stackCapacity,
+                          depth);
+    memcpy(&ir->stacks[block->exit], *stack, sizeof(int) * depth);
+
+    // A jump back has to find the stack the way the loop started with it.
+    for (int i = 0; i < block->successorCount; i++) {
+        int successor = block->successors[i];
+        if (irIsBackEdge(ir, b, successor) &&
+            ir->blocks[successor].depth != depth) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Counts the values each edge hands to a block's parameters as used.
+static void useIncoming(IrFunction *ir) {
+    for (int b = 0; b < ir->blockCount; b++) {
+        IrBlock *block = &ir->blocks[b];
+        if (block->params == -1) continue;
+        for (int i = 0; i < block->predecessorCount; i++) {
+            IrBlock *from = &ir->blocks[ir->edges[block->predecessors + i]];
+            if (from->depth == -1) continue;
+            for (int j = 0; j < block->depth; j++) {
+                ir->values[ir->stacks[from->exit + j]].uses++;
+            }
+        }
+    }
+}
+
+bool irBuild(IrFunction *ir, ObjFunction *function) {
+    ir->function = function;
+    ir->values = NULL;
+    ir->valueCount = ir->valueCapacity = 0;
+    ir->inputs = NULL;
+    ir->inputCount = ir->inputCapacity = 0;
+    ir->stacks = NULL;
+    ir->stackCount = ir->stackCapacity = 0;
+    ir->added = NULL;
+    ir->addedCount = ir->addedCapacity = 0;
+    decode(ir);
+    findBlocks(ir);
+    orderBlocks(ir);
+    markCaptures(ir);
+
+    for (int b = 0; b < ir->blockCount; b++) {
+        IrBlock *block = &ir->blocks[b];
+        if (block->rank != -1) continue;
+        for (int i = block->start; i < block->end; i++) {
+            ir->code[i].removed = true;
+        }
+    }
+
+    int *stack = NULL;
+    int capacity = 0;
+    bool ok = true;
+    for (int i = 0; ok && i < ir->orderCount; i++) {
+        ok = enterBlock(ir, ir->order[i]) &&
+             followBlock(ir, ir->order[i], &stack, &capacity);
+    }
+    FREE_ARRAY(int, stack, capacity);
+
+    if (!ok) {
+        irFree(ir);
+        return false;
+    }
+    useIncoming(ir);
+    return true;
+}
+
+void irFree(IrFunction *ir) {
+    FREE_ARRAY(IrInstruction, ir->code, ir->count);
+    FREE_ARRAY(IrBlock, ir->blocks, ir->blockCount);
+    FREE_ARRAY(int, ir->order, ir->blockCount);
+    FREE_ARRAY(IrValue, ir->values, ir->valueCapacity);
+    FREE_ARRAY(int, ir->inputs, ir->inputCapacity);
+    FREE_ARRAY(int, ir->stacks, ir->stackCapacity);
+    FREE_ARRAY(int, ir->edges, ir->edgeCount);
+    FREE_ARRAY(IrInstruction, ir->added, ir->addedCapacity);
+}
+
+// Values are only shared the way the compiler shares them: -0 would be
+// taken for 0, and functions are unique anyway.
+static bool sameConstant(Value a, Value b) {
+    if (IS_OBJ(a) && !IS_STRING(a)) return false;
+    if (IS_NUMBER(a) && AS_NUMBER(a) == 0 && signbit(AS_NUMBER(a))) {
+        return false;
+    }
+    return IS_INT(a) == IS_INT(b) && valuesEqual(a, b);
+}
+
+int irConstant(IrFunction *ir, Value value) {
+    ValueArray *constants = &ir->function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (sameConstant(value, constants->values[i])) return i;
+    }
+    return addConstant(&ir->function->chunk, value);
+}
+
+int irInlineFrame(IrFunction *ir, ObjString *name, int line, int parent) {
+    Chunk *chunk = &ir->function->chunk;
+    chunk->inlineFrames =
+        GROW_ARRAY(InlineFrame, chunk->inlineFrames, chunk->inlineFrameCount,
+                   chunk->inlineFrameCount + 1);
+    InlineFrame *frame = &chunk->inlineFrames[chunk->inlineFrameCount];
+    frame->name = REF(name);
+    frame->line = line;
+    frame->parent = parent;
+    return chunk->inlineFrameCount++;
+}
+
+static int addCode(IrFunction *ir, const IrInstruction *code, int count) {
+    if (ir->addedCount + count > ir->addedCapacity) {
+        int oldCapacity = ir->addedCapacity;
+        while (ir->addedCapacity < ir->addedCount + count) {
+            ir->addedCapacity = GROW_CAPACITY(ir->addedCapacity);
+        }
+        ir->added = GROW_ARRAY(IrInstruction, ir->added, oldCapacity,
+                               ir->addedCapacity);
+    }
+    memcpy(&ir->added[ir->addedCount], code, sizeof(IrInstruction) * count);
+    ir->addedCount += count;
+    return ir->addedCount - count;
+}
+
+void irReplace(IrFunction *ir, int index, const IrInstruction *code,
+               int count) {
+    ir->code[index].replacement = addCode(ir, code, count);
+    ir->code[index].replacementCount = count;
+}
+
+void irInsert(IrFunction *ir, int index, const IrInstruction *code,
+              int count) {
+    ir->code[index].prefix = addCode(ir, code, count);
+    ir->code[index].prefixCount = count;
+}
+
+// Lowered code being put together.
+typedef struct {
+    Chunk chunk;
+    InlineRun *runs;
+    int runCount;
+    int runCapacity;
+} Lowering;
+
+static void emit(Lowering *lowering, const IrFunction *ir,
+                 const IrInstruction *instruction) {
+    Chunk *out = &lowering->chunk;
+    int frame = lowering->runCount > 0
+                    ? lowering->runs[lowering->runCount - 1].frame
+                    : -1;
+    if (instruction->frame != frame) {
+        if (lowering->runCount == lowering->runCapacity) {
+            int oldCapacity = lowering->runCapacity;
+            lowering->runCapacity = GROW_CAPACITY(oldCapacity);
+            lowering->runs = GROW_ARRAY(InlineRun, lowering->runs,
+                                        oldCapacity, lowering->runCapacity);
+        }
+        InlineRun *run = &lowering->runs[lowering->runCount++];
+        run->start = out->count;
+        run->frame = instruction->frame;
+    }
+
+    int line = instruction->line;
+    int op = instruction->op;
+    int operand = instruction->operand;
+    if (hasConstantOperand(op) && operand > UINT8_MAX) {
+        writeChunk(out, OP_WIDE, line);
+        writeChunk(out, (operand >> 16) & 0xff, line);
+        writeChunk(out, (operand >> 8) & 0xff, line);
+    }
+    writeChunk(out, op, line);
+    if (hasByteOperand(op)) writeChunk(out, operand & 0xff, line);
+    if (op == OP_INVOKE || op == OP_SUPER_INVOKE) {
+        writeChunk(out, instruction->argCount, line);
+    }
+    if (instruction->captures != NULL) {
+        int count = upvalueCount(ir, operand);
+        for (int i = 0; i < 2 * count; i++) {
+            writeChunk(out, instruction->captures[i], line);
+        }
+    }
+    if (isJump(op)) {
+        // Patched once every block has its offset.
+        writeChunk(out, 0xff, line);
+        writeChunk(out, 0xff, line);
+    }
+}
+
+bool irLower(IrFunction *ir) {
+    Chunk *chunk = &ir->function->chunk;
+    Lowering lowering;
+    initChunk(&lowering.chunk);
+    lowering.runs = NULL;
+    lowering.runCount = lowering.runCapacity = 0;
+    Chunk *out = &lowering.chunk;
+    // Where a block starts, and where it starts past its first instruction's
+    // prefix.
+    int *blockOffset = ALLOCATE(int, ir->blockCount);
+    int *bodyOffset = ALLOCATE(int, ir->blockCount);
+    int *jumpOffset = ALLOCATE(int, ir->count);
+    for (int b = 0; b < ir->blockCount; b++) {
+        IrBlock *block = &ir->blocks[b];
+        blockOffset[b] = out->count;
+        for (int i = block->start; i < block->end; i++) {
+            IrInstruction *instruction = &ir->code[i];
+            for (int j = 0; j < instruction->prefixCount; j++) {
+                emit(&lowering, ir, &ir->added[instruction->prefix + j]);
+            }
+            if (i == block->start) bodyOffset[b] = out->count;
+            if (instruction->removed) continue;
+            if (instruction->replacementCount > 0) {
+                for (int j = 0; j < instruction->replacementCount; j++) {
+                    emit(&lowering, ir,
+                         &ir->added[instruction->replacement + j]);
+                }
+                continue;
+            }
+            emit(&lowering, ir, instruction);
+            jumpOffset[i] = out->count - 2;
+        }
+    }
+
+    bool fits = true;
+    for (int b = 0; b < ir->blockCount; b++) {
+        IrBlock *block = &ir->blocks[b];
+        for (int i = block->start; i < block->end; i++) {
+            IrInstruction *instruction = &ir->code[i];
+            if (instruction->removed || instruction->replacementCount > 0 ||
+                !isJump(instruction->op)) {
+                continue;
+            }
+
+            uint8_t *code = &out->code[jumpOffset[i]];
+            int from = jumpOffset[i] + 2;
+            int to = irIsBackEdge(ir, b, instruction->target)
+                         ? bodyOffset[instruction->target]
+                         : blockOffset[instruction->target];
+            if (instruction->op == OP_JUMP || instruction->op == OP_LOOP) {
+                code[-1] = to >= from ? OP_JUMP : OP_LOOP;
+            } else if (to < from) {
+                fits = false;
+            }
+            int jump = to >= from ? to - from : from - to;
+            if (jump > UINT16_MAX) fits = false;
+            code[0] = (jump >> 8) & 0xff;
+            code[1] = jump & 0xff;
+        }
+    }
+    FREE_ARRAY(int, jumpOffset, ir->count);
+    FREE_ARRAY(int, bodyOffset, ir->blockCount);
+    FREE_ARRAY(int, blockOffset, ir->blockCount);
+
+    if (!fits) {
+        freeChunk(out);
+        FREE_ARRAY(InlineRun, lowering.runs, lowering.runCapacity);
+        return false;
+    }
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    freeLines(&chunk->lines);
+    FREE_ARRAY(InlineRun, chunk->inlineRuns, chunk->inlineRunCount);
+    chunk->code = out->code;
+    chunk->count = out->count;
+    chunk->capacity = out->capacity;
+    chunk->lines = out->lines;
+    chunk->inlineRuns = GROW_ARRAY(InlineRun, lowering.runs,
+                                   lowering.runCapacity, lowering.runCount);
+    chunk->inlineRunCount = lowering.runCount;
+    freeValueArray(&out->constants);
+    return true;
+}
+
+static void printValues(const IrFunction *ir, const int *values, int count) {
+    for (int i = 0; i < count; i++) printf(" v%d", values[i]);
+}
+
+void irPrint(const IrFunction *ir, const char *name) {
+    printf("== %s ir ==\n", name);
+    for (int b = 0; b < ir->blockCount; b++) {
+        const IrBlock *block = &ir->blocks[b];
+        printf("block %d", b);
+        if (block->depth == -1) {
+            printf(" (unreachable)\n");
+            continue;
+        }
+        if (block->params != -1) {
+            printf(" (");
+            printValues(ir, &ir->stacks[block->entry], block->depth);
+            printf(" )");
+        }
+        printf(" <-");
+        for (int i = 0; i < block->predecessorCount; i++) {
+            printf(" %d", ir->edges[block->predecessors + i]);
+        }
+        printf("\n");
+
+        for (int i = block->start; i < block->end; i++) {
+            const IrInstruction *instruction = &ir->code[i];
+            if (instruction->removed) continue;
+            printf("%4d  ", instruction->line);
+            if (instruction->output != -1) {
+                printf("v%-4d = ", instruction->output);
+            } else {
+                printf("%8s", "");
+            }
+            printf("%-16s", opcodeName(instruction->op));
+            if (hasByteOperand(instruction->op)) {
+                printf(" %4d", instruction->operand);
+            }
+            if (instruction->target != -1) {
+                printf(" -> %d", instruction->target);
+            }
+            printValues(ir, &ir->inputs[instruction->inputs],
+                        instruction->inputCount);
+            printf("\n");
+        }
+    }
+}
@@ -0,0 +1,135 @@
+#ifndef clox_ir_h
+#define clox_ir_h
+
+#include "chunk.h"
+
+// A function's bytecode lifted into basic blocks, with the values its
+// instructions pass over the stack numbered in SSA form: each value has a
+// single definition, and a block more than one edge leads to takes the stack
+// it starts with as parameters. Locals are stack slots, so reading one is a
+// copy of whatever value the slot holds at that point.
+//
+// Passes edit instructions in place and irLower() encodes them again, so an
+// edit has to leave every block with the same stack shape it had.
+
+typedef struct {
+    // The opcode, with any OP_WIDE prefix folded into `operand`.
+    uint8_t op;
+    // Constant index, slot, element count or argument count.
+    int operand;
+    // Argument count of OP_INVOKE and OP_SUPER_INVOKE.
+    int argCount;
+    int line;
+    // Inline frame of the chunk it came from, or -1.
+    int frame;
+    // Block a jump goes to, or -1.
+    int target;
+    // Capture pairs of OP_CLOSURE and OP_FRAME_CLOSURE, within the code the
+    // function was lifted from.
+    const uint8_t *captures;
+    // Values read off the top of the stack, deepest first, as a range of
+    // IrFunction.inputs. The top `pops` of them are removed.
+    int inputs;
+    int inputCount;
+    int pops;
+    // Value pushed, or -1.
+    int output;
+    // Stack depth before it runs.
+    int depth;
+    // Instructions lowered in its place, as a range of IrFunction.added.
+    int replacement;
+    int replacementCount;
+    // Instructions lowered ahead of it, as a range of IrFunction.added.
+    int prefix;
+    int prefixCount;
+    bool removed;
+} IrInstruction;
+
+typedef struct {
+    // Instruction defining it, or -1 for a block parameter.
+    int def;
+    int block;
+    // Instructions, slot reads and block edges using it.
+    int uses;
+    // Value in the local slot an OP_GET_LOCAL copied, or -1 when the slot may
+    // change behind the function's back.
+    int copyOf;
+} IrValue;
+
+typedef struct {
+    int start;
+    int end;
+    // Position in IrFunction.order, or -1 when nothing reaches the block.
+    int rank;
+    // Stack depth on entry, or -1 when nothing reaches the block.
+    int depth;
+    // Values on the stack on entry and exit, as ranges of IrFunction.stacks.
+    int entry;
+    int exit;
+    int exitDepth;
+    // First parameter value, or -1 when it inherits its only predecessor's
+    // stack.
+    int params;
+    int successors[2];
+    int successorCount;
+    // Blocks with an edge here, as a range of IrFunction.edges.
+    int predecessors;
+    int predecessorCount;
+} IrBlock;
+
+typedef struct {
+    ObjFunction *function;
+    IrInstruction *code;
+    int count;
+    IrBlock *blocks;
+    int blockCount;
+    // Reachable blocks in reverse postorder: each comes after every block
+    // leading to it other than through a loop's back edge.
+    int *order;
+    int orderCount;
+    IrValue *values;
+    int valueCount;
+    int valueCapacity;
+    int *inputs;
+    int inputCount;
+    int inputCapacity;
+    int *stacks;
+    int stackCount;
+    int stackCapacity;
+    int *edges;
+    int edgeCount;
+    IrInstruction *added;
+    int addedCount;
+    int addedCapacity;
+    // Slots a closure captures; a call may change them.
+    bool captured[UINT8_COUNT];
+} IrFunction;
+
+// Lifts the function's code. Returns false, with nothing to free, for code
+// the stack can't be followed through.
+bool irBuild(IrFunction *ir, ObjFunction *function);
+void irFree(IrFunction *ir);
+// Whether the edge from block `from` to block `to` closes a loop.
+bool irIsBackEdge(const IrFunction *ir, int from, int to);
+// Encodes the instructions not removed back into the function's chunk,
+// leaving it as it was if a jump no longer fits.
+bool irLower(IrFunction *ir);
+// Index of a constant equal to `value` in the function's chunk, added if
+// there is none.
+int irConstant(IrFunction *ir, Value value);
+// Index of a new inline frame in the function's chunk.
+int irInlineFrame(IrFunction *ir, ObjString *name, int line, int parent);
+// Has `count` instructions, none of them jumps, lowered in place of the one
+// at `index`. Nothing about them is known until the code is lifted again.
+void irReplace(IrFunction *ir, int index, const IrInstruction *code,
+               int count);
+// Has `count` instructions, none of them jumps, lowered ahead of the one at
+// `index`, even when it is removed. A jump to its block lands ahead of them
+// unless it closes a loop, so code put at the start of a loop header runs
+// once on the way in.
+void irInsert(IrFunction *ir, int index, const IrInstruction *code,
+              int count);
+
+void irPrint(const IrFunction *ir, const char *name);
+
+#endif
@@ -43,8 +43,13 @@ void writeLines(Lines *lines, int offset, int line) {
     int lastCount = lastPos >> 24;
     int lastLine = lastPos & 0x00ffffff;
     if (lastLine == line) {
-        // increment the count by 1
-        lines->lines[lines->count - 1] = ((lastCount + 1) << 24) | line;
+        // increment the count by 1, starting a new run once it is full
+        if (lastCount < 255) {
+            lines->lines[lines->count - 1] =
+                ((line_pos_t)(lastCount + 1) << 24) | line;
+        } else {
+            appendLinePos(lines, ((line_pos_t)1 << 24) | line);
+        }
         lines->offset = offset;
         return;
     }
@@ -58,13 +63,37 @@ void writeLines(Lines *lines, int offset, int line) {
     lastCount = offset - lines->offset;
     while (lastCount > 0) {
         int count = lastCount > 255 ? 255 : lastCount;
-        lastPos = ((count) << 24) | line;
+        lastPos = ((line_pos_t)count << 24) | line;
         appendLinePos(lines, lastPos);
         lastCount -= count;
     }
     lines->offset = offset;
 }
 
+void truncateLines(Lines *lines, int offset) {
+    if (offset == 0) {
+        lines->count = 0;
+        lines->offset = -1;
+        return;
+    }
+
+    // drop counts from the last runs until they add up to offset - 1
+    int excess = lines->offset - (offset - 1);
+    while (excess > 0) {
+        line_pos_t lastPos = lines->lines[lines->count - 1];
+        int lastCount = lastPos >> 24;
+        if (lastCount > excess || lines->count == 1) {
+            lines->lines[lines->count - 1] =
+                ((line_pos_t)(lastCount - excess) << 24) |
+                (lastPos & 0x00ffffff);
+            break;
+        }
+        lines->count--;
+        excess -= lastCount;
+    }
+    lines->offset = offset - 1;
+}
+
 void freeLines(Lines *lines) {
     FREE_ARRAY(line_pos_t, lines->lines, lines->capacity);
     initLines(lines);
@@ -88,4 +117,17 @@ int getLineByOffset(const Lines *lines, int offset) {
     }
 
     return -1;
-}
\ No newline at end of file
+}
+
+void getLines(const Lines *lines, int *lineAt, int count) {
+    int offset = 0;
+    int runningOffset = 0;
+    for (int i = 0; i < lines->count && offset < count; i++) {
+        line_pos_t linePos = lines->lines[i];
+        int line = linePos & 0x00ffffff;
+        runningOffset += linePos >> 24;
+        while (offset <= runningOffset && offset < count) {
+            lineAt[offset++] = line;
+        }
+    }
+}
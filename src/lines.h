@@ -20,6 +20,10 @@ typedef struct {
 void initLines(Lines *lines);
 void freeLines(Lines *lines);
 void writeLines(Lines *lines, int offset, int line);
+// Forgets the lines of every offset from `offset` on.
+void truncateLines(Lines *lines, int offset);
 int getLineByOffset(const Lines *lines, int offset);
+// Fills lineAt[offset] for the first `count` offsets in one pass.
+void getLines(const Lines *lines, int *lineAt, int count);
 
 #endif
\ No newline at end of file
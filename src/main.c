@@ -1,9 +1,12 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "cache.h"
 #include "chunk.h"
 #include "common.h"
+#include "compiler.h"
 #include "debug.h"
 #include "vm.h"
 
@@ -48,25 +51,111 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
+// Where --cache and --cache-dir keep a script's bytecode, or NULL.
+static bool cacheNextToSource = false;
+static const char* cacheDir = NULL;
+
+// The .loxc file for `path`: beside it, with the extension swapped, or in
+// the cache dir under the key.
+static char* cachePath(const char* path, uint64_t key) {
+    size_t length = strlen(path) + (cacheDir != NULL ? strlen(cacheDir) : 0) +
+                    32;
+    char* cache = (char*)malloc(length);
+    if (cache == NULL) return NULL;
+    if (cacheDir != NULL) {
+        snprintf(cache, length, "%s/%016llx.loxc", cacheDir,
+                 (unsigned long long)key);
+        return cache;
+    }
+
+    size_t stem = strlen(path);
+    if (stem > 4 && strcmp(path + stem - 4, ".lox") == 0) stem -= 4;
+    snprintf(cache, length, "%.*s.loxc", (int)stem, path);
+    return cache;
+}
+
+static InterpretResult runCached(const char* path, const char* source) {
+    uint64_t key = bytecodeKey(source);
+    char* cache = cachePath(path, key);
+    if (cache == NULL) return interpret(source);
+
+    ObjFunction* function = loadBytecode(cache, key);
+    if (function == NULL) {
+        function = compile(source);
+        if (function == NULL) {
+            free(cache);
+            return INTERPRET_COMPILE_ERROR;
+        }
+        saveBytecode(cache, function, key);
+    }
+    free(cache);
+    return interpretFunction(function);
+}
+
 static void runFile(const char* path) {
     char* source = readFile(path);
-    InterpretResult result = interpret(source);
+    InterpretResult result = cacheNextToSource || cacheDir != NULL
+                                 ? runCached(path, source)
+                                 : interpret(source);
     free(source);
 
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+// A whole decimal number from 1 to INT32_MAX, or -1.
+static int parseCount(const char* text) {
+    char* end;
+    errno = 0;
+    long value = strtol(text, &end, 10);
+    if (errno != 0 || end == text || *end != '\0' || value < 1 ||
+        value > INT32_MAX) {
+        return -1;
+    }
+    return (int)value;
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: clox [--max-depth N] [--no-peephole] [--optimize]\n"
+                    "            [--print-inlining] [--cache | --cache-dir DIR]"
+                    " [path]\n");
+    exit(64);
+}
+
 int main(int argc, char* argv[]) {
     initVM();
 
-    if (argc == 1) {
+    const char* path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc) {
+            vm.maxFrames = parseCount(argv[++i]);
+            if (vm.maxFrames < 1) usage();
+        } else if (strcmp(argv[i], "--no-peephole") == 0) {
+            compilerOptions.peephole = false;
+        } else if (strcmp(argv[i], "--optimize") == 0) {
+            compilerOptions.optimize = true;
+        } else if (strcmp(argv[i], "--print-inlining") == 0) {
+            compilerOptions.printInlining = true;
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            cacheNextToSource = true;
+        } else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+            cacheDir = argv[++i];
+        } else if (path == NULL) {
+            path = argv[i];
+        } else {
+            usage();
+        }
+    }
+
+    if (path == NULL) {
+        // Each line is compiled on its own, and later ones can change what
+        // the passes took for granted, so the REPL stays single-pass and
+        // leaves native calls unbound.
+        compilerOptions.optimize = false;
+        compilerOptions.bindNatives = false;
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        runFile(path);
     }
 
     freeVM();
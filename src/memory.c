@@ -13,7 +13,7 @@
 
 #define GC_HEAP_GROW_FACTOR 2
 
-void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+static void trackAllocation(size_t oldSize, size_t newSize) {
     vm.bytesAllocated += newSize - oldSize;
 
     if (newSize > oldSize) {
@@ -24,6 +24,10 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
             collectGarbage();
         }
     }
+}
+
+void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+    trackAllocation(oldSize, newSize);
 
     if (newSize == 0) {
         free(pointer);
@@ -31,77 +35,118 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
     }
 
     void *result = realloc(pointer, newSize);
-    if (result == NULL) exit(1);
+    if (result == NULL) {
+        // What the collector frees may be enough.
+        collectGarbage();
+        result = realloc(pointer, newSize);
+    }
+    if (result == NULL) outOfMemory();
     return result;
 }
 
+void *reallocateObject(void *pointer, size_t oldSize, size_t newSize) {
+    trackAllocation(oldSize, newSize);
+
+    if (newSize == 0) {
+        heapFree(pointer);
+        return NULL;
+    }
+    void *block = heapAllocate(newSize);
+    if (block == NULL) {
+        // What the collector frees may be enough.
+        collectGarbage();
+        block = heapAllocate(newSize);
+    }
+    if (block == NULL) outOfMemory();
+    return block;
+}
+
 static void freeObject(Obj *object) {
 #ifdef DEBUG_LOG_GC
-    printDebugObjectHeader("free", object);
+    // Objects it references may have been swept already; skip the value.
+    printf("%p %-7s [%-12s]\n", (void *)object, "free",
+           objTypeToString((ObjType)object->type));
 #endif
 
-    switch (object->type) {
+    switch ((ObjType)object->type) {
         case OBJ_BOUND_METHOD: {
-            FREE(ObjBoundMethod, object);
+            FREE_OBJ(ObjBoundMethod, object);
             break;
         }
 
         case OBJ_CLASS: {
-            FREE(ObjClass, object);
             ObjClass *klass = (ObjClass *)object;
             freeTable((Table *)&klass->methods);
-
+            FREE_OBJ(ObjClass, object);
             break;
         }
 
         case OBJ_CLOSURE: {
             ObjClosure *closure = (ObjClosure *)object;
-            FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCount);
+            reallocateObject(object, closureSize(closure->upvalueCount), 0);
+            break;
+        }
 
-            FREE(ObjClosure, object);
+        case OBJ_FLOAT64_ARRAY: {
+            ObjFloat64Array *array = (ObjFloat64Array *)object;
+            reallocateObject(object, float64ArraySize(array->length), 0);
             break;
         }
 
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction *)object;
             freeChunk((Chunk *)&function->chunk);
-            FREE(ObjFunction, object);
+            FREE_OBJ(ObjFunction, object);
             break;
         }
 
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance *)object;
             freeTable((Table *)&instance->fields);
-            FREE(ObjInstance, object);
+            FREE_OBJ(ObjInstance, object);
+            break;
+        }
+
+        case OBJ_LIST: {
+            ObjList *list = (ObjList *)object;
+            freeValueArray(&list->items);
+            FREE_OBJ(ObjList, object);
+            break;
+        }
+
+        case OBJ_MAP: {
+            ObjMap *map = (ObjMap *)object;
+            freeValueTable((ValueTable *)&map->table);
+            FREE_OBJ(ObjMap, object);
             break;
         }
 
         case OBJ_NATIVE: {
-            FREE(ObjNative, object);
+            FREE_OBJ(ObjNative, object);
+            break;
+        }
+
+        case OBJ_ROPE: {
+            FREE_OBJ(ObjRope, object);
             break;
         }
 
         case OBJ_STRING: {
             ObjString *string = (ObjString *)object;
-            reallocate(object, sizeof(ObjString) + string->length + 1, 0);
+            reallocateObject(object, sizeof(ObjString) + string->length + 1,
+                             0);
             break;
         }
 
         case OBJ_UPVALUE: {
-            FREE(ObjUpvalue, object);
+            FREE_OBJ(ObjUpvalue, object);
             break;
         }
     }
 }
 
 void freeObjects() {
-    Obj *object = vm.objects;
-    while (object != NULL) {
-        Obj *next = (Obj *)object->next;
-        freeObject(object);
-        object = next;
-    }
-
+    sweepHeap(freeObject);
     free(vm.grayStack);
 }
 
@@ -120,48 +165,71 @@ static void blackenObject(Obj *object) {
     printDebugObjectHeader("blacken", object);
 #endif
 
-    switch (object->type) {
+    switch ((ObjType)object->type) {
         case OBJ_BOUND_METHOD: {
             ObjBoundMethod *bound = (ObjBoundMethod *)object;
             markValue(bound->receiver);
-            markObject((Obj *)bound->method);
+            markObject((Obj *)DEREF(ObjClosure, bound->method));
             break;
         }
 
         case OBJ_CLASS: {
             ObjClass *klass = (ObjClass *)object;
-            markObject((Obj *)klass->name);
+            markObject((Obj *)DEREF(ObjString, klass->name));
             markTable((Table *)&klass->methods);
             break;
         }
 
         case OBJ_CLOSURE: {
             ObjClosure *closure = (ObjClosure *)object;
-            markObject((Obj *)closure->function);
+            markObject((Obj *)DEREF(ObjFunction, closure->function));
             for (int i = 0; i < closure->upvalueCount; i++) {
-                markObject((Obj *)closure->upvalues[i]);
+                markObject((Obj *)DEREF(ObjUpvalue, closure->upvalues[i]));
             }
             break;
         }
 
         case OBJ_FUNCTION: {
             ObjFunction *function = (ObjFunction *)object;
-            markObject((Obj *)function->name);
+            markObject((Obj *)DEREF(ObjString, function->name));
             markArray(&function->chunk.constants);
+            for (int i = 0; i < function->chunk.inlineFrameCount; i++) {
+                InlineFrame *frame = &function->chunk.inlineFrames[i];
+                markObject((Obj *)DEREF(ObjString, frame->name));
+            }
             break;
         }
 
         case OBJ_INSTANCE: {
             ObjInstance *instance = (ObjInstance *)object;
-            markObject((Obj *)instance->klass);
+            markObject((Obj *)DEREF(ObjClass, instance->klass));
             markTable((Table *)&instance->fields);
             break;
         }
 
+        case OBJ_LIST: {
+            markArray(&((ObjList *)object)->items);
+            break;
+        }
+
+        case OBJ_MAP: {
+            markValueTable((ValueTable *)&((ObjMap *)object)->table);
+            break;
+        }
+
+        case OBJ_ROPE: {
+            ObjRope *rope = (ObjRope *)object;
+            markValue(rope->left);
+            markValue(rope->right);
+            markObject((Obj *)DEREF(ObjString, rope->flat));
+            break;
+        }
+
         case OBJ_UPVALUE: {
             markValue(((ObjUpvalue *)object)->closed);
             break;
         }
+        case OBJ_FLOAT64_ARRAY:
         case OBJ_NATIVE:
         case OBJ_STRING:
             break;
@@ -177,10 +245,8 @@ static void markRoots() {
         markObject((Obj *)vm.frames[i].closure);
     }
 
-    for (ObjUpvalue *upvalue = vm.openUpvalues;  //
-         upvalue != NULL;                        //
-         upvalue = (ObjUpvalue *)upvalue->next) {
-        markObject((Obj *)upvalue);
+    for (int i = 0; i < vm.openUpvalueTop; i++) {
+        markObject((Obj *)vm.openUpvalues[i]);
     }
 
     markTable(&vm.globals);
@@ -195,28 +261,17 @@ static void traceReferences() {
     }
 }
 
-static void sweep() {
-    Obj *previous = NULL;
-    Obj *object = vm.objects;
-    while (object != NULL) {
-        if (object->isMarked) {
-            object->isMarked = false;
-            previous = object;
-            object = (Obj *)object->next;
-        } else {
-            Obj *unreached = object;
-            object = (Obj *)object->next;
-            if (previous != NULL) {
-                previous->next = (void *)object;
-            } else {
-                vm.objects = object;
-            }
-
-            freeObject(unreached);
-        }
+static void sweepObject(Obj *object) {
+    if (object->isMarked) {
+        object->isMarked = false;
+        if (object->age < UINT8_MAX) object->age++;
+    } else {
+        freeObject(object);
     }
 }
 
+static void sweep() { sweepHeap(sweepObject); }
+
 void collectGarbage() {
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
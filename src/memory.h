@@ -16,8 +16,11 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE_OBJ(type, pointer) reallocateObject(pointer, sizeof(type), 0)
 
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+// Objects come from the heap region; they are only allocated or freed.
+void *reallocateObject(void *pointer, size_t oldSize, size_t newSize);
 void markValue(Value value);
 void collectGarbage();
 void freeObjects();
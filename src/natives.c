@@ -0,0 +1,383 @@
+// clock_gettime() is outside of strict C99.
+#define _DEFAULT_SOURCE
+
+#include "natives.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "memory.h"
+#include "vector.h"
+#include "vm.h"
+
+static double clockNanos(clockid_t clockId) {
+    struct timespec now;
+    clock_gettime(clockId, &now);
+    return (double)now.tv_sec * 1e9 + (double)now.tv_nsec;
+}
+
+static bool clockNative(VM *vm, int argCount, Value *args, Value *result) {
+    *result = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    return true;
+}
+
+// Monotonic wall time in nanoseconds, from an arbitrary start.
+static bool nanoTimeNative(VM *vm, int argCount, Value *args, Value *result) {
+    *result = NUMBER_VAL(clockNanos(CLOCK_MONOTONIC));
+    return true;
+}
+
+// CPU time of the process in nanoseconds.
+static bool cpuTimeNative(VM *vm, int argCount, Value *args, Value *result) {
+    *result = NUMBER_VAL(clockNanos(CLOCK_PROCESS_CPUTIME_ID));
+    return true;
+}
+
+// CPU time of the calling thread in nanoseconds.
+static bool threadTimeNative(VM *vm, int argCount, Value *args,
+                             Value *result) {
+    *result = NUMBER_VAL(clockNanos(CLOCK_THREAD_CPUTIME_ID));
+    return true;
+}
+
+// The raw cycle counter; nanoseconds where the CPU has none we can read.
+static bool cyclesNative(VM *vm, int argCount, Value *args, Value *result) {
+#if defined(__x86_64__) || defined(__i386__)
+    *result = NUMBER_VAL((double)__rdtsc());
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+    *result = NUMBER_VAL((double)ticks);
+#else
+    *result = NUMBER_VAL(clockNanos(CLOCK_MONOTONIC));
+#endif
+    return true;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// The sample at the given percentile of a sorted array.
+static double percentile(const double *samples, int count, int percent) {
+    int index = (int)((long)(count - 1) * percent / 100);
+    return samples[index];
+}
+
+// Calls fn() the given number of times after a warmup of a tenth as many
+// calls, times every call, prints the distribution and returns the median
+// in nanoseconds.
+static bool benchNative(VM *vm, int argCount, Value *args, Value *result) {
+    Value fn = args[0];
+    // Range checked before the cast, which is undefined past INT32_MAX.
+    if (!IS_NUMBER(args[1]) ||
+        !(AS_NUMBER(args[1]) >= 1 && AS_NUMBER(args[1]) <= INT32_MAX)) {
+        runtimeError("Iterations must be a number from 1 to %d.", INT32_MAX);
+        return false;
+    }
+    int iterations = (int)AS_NUMBER(args[1]);
+
+    for (int i = 0; i < iterations / 10; i++) {
+        push(fn);
+        if (!callFromNative(fn, 0)) return false;
+        pop();
+    }
+
+    double *samples = (double *)malloc(sizeof(double) * iterations);
+    if (samples == NULL) {
+        runtimeError("Not enough memory for %d samples.", iterations);
+        return false;
+    }
+    for (int i = 0; i < iterations; i++) {
+        push(fn);
+        double start = clockNanos(CLOCK_MONOTONIC);
+        if (!callFromNative(fn, 0)) {
+            free(samples);
+            return false;
+        }
+        samples[i] = clockNanos(CLOCK_MONOTONIC) - start;
+        pop();
+    }
+
+    qsort(samples, iterations, sizeof(double), compareDoubles);
+    double median = percentile(samples, iterations, 50);
+    printf("bench: %d iterations, median %.0f ns, p90 %.0f ns, "
+           "p99 %.0f ns, min %.0f ns, max %.0f ns\n",
+           iterations, median, percentile(samples, iterations, 90),
+           percentile(samples, iterations, 99), samples[0],
+           samples[iterations - 1]);
+    free(samples);
+
+    *result = NUMBER_VAL(median);
+    return true;
+}
+
+// Direct calls to len() and append() compile to OP_LENGTH and
+// OP_LIST_APPEND; these only run when called through a value.
+static bool lenNative(VM *vm, int argCount, Value *args, Value *result) {
+    if (IS_LIST(args[0])) {
+        *result = INT_VAL(AS_LIST(args[0])->items.count);
+    } else if (IS_MAP(args[0])) {
+        *result = INT_VAL(AS_MAP(args[0])->table.size);
+    } else if (IS_FLOAT64_ARRAY(args[0])) {
+        *result = INT_VAL(AS_FLOAT64_ARRAY(args[0])->length);
+    } else {
+        runtimeError("Only lists, maps and arrays have a length.");
+        return false;
+    }
+    return true;
+}
+
+static bool appendNative(VM *vm, int argCount, Value *args, Value *result) {
+    if (!IS_LIST(args[0])) {
+        runtimeError("Can only append to a list.");
+        return false;
+    }
+    writeValueArray(&AS_LIST(args[0])->items, args[1]);
+    *result = NIL_VAL;
+    return true;
+}
+
+// Checks the map argument and canonicalizes the key after it, which must be
+// the last argument.
+static bool mapArguments(Value *args) {
+    if (!IS_MAP(args[0])) {
+        runtimeError("Expected a map.");
+        return false;
+    }
+    return mapKeyAt(0);
+}
+
+static bool hasNative(VM *vm, int argCount, Value *args, Value *result) {
+    if (!mapArguments(args)) return false;
+    Value value;
+    *result = BOOL_VAL(
+        valueTableGet((ValueTable *)&AS_MAP(args[0])->table, args[1], &value));
+    return true;
+}
+
+static bool removeNative(VM *vm, int argCount, Value *args, Value *result) {
+    if (!mapArguments(args)) return false;
+    *result = BOOL_VAL(
+        valueTableDelete((ValueTable *)&AS_MAP(args[0])->table, args[1]));
+    return true;
+}
+
+// A list of the map's keys, so the map can change while they are walked.
+static bool keysNative(VM *vm, int argCount, Value *args, Value *result) {
+    if (!IS_MAP(args[0])) {
+        runtimeError("Expected a map.");
+        return false;
+    }
+
+    ValueTable *table = (ValueTable *)&AS_MAP(args[0])->table;
+    ObjList *list = newList();
+    push(OBJ_VAL(list));
+    if (table->size > 0) {
+        list->items.values = GROW_ARRAY(Value, NULL, 0, table->size);
+        list->items.capacity = table->size;
+    }
+    int cursor = 0;
+    Value key, value;
+    while (valueTableNext(table, &cursor, &key, &value)) {
+        list->items.values[list->items.count++] = key;
+    }
+    pop();
+
+    *result = OBJ_VAL(list);
+    return true;
+}
+
+// Float64Array(length) is zero filled; Float64Array(list) copies numbers.
+static bool float64ArrayNative(VM *vm, int argCount, Value *args,
+                               Value *result) {
+    if (IS_LIST(args[0])) {
+        ObjList *list = AS_LIST(args[0]);
+        for (int i = 0; i < list->items.count; i++) {
+            if (!IS_NUMBER(list->items.values[i])) {
+                runtimeError("Array items must be numbers.");
+                return false;
+            }
+        }
+        ObjFloat64Array *array = newFloat64Array(list->items.count);
+        for (int i = 0; i < array->length; i++) {
+            array->values[i] = AS_NUMBER(list->items.values[i]);
+        }
+        *result = OBJ_VAL(array);
+        return true;
+    }
+
+    // Range checked before the cast, which is undefined past INT32_MAX.
+    if (!IS_NUMBER(args[0]) ||
+        !(AS_NUMBER(args[0]) >= 0 && AS_NUMBER(args[0]) <= INT32_MAX) ||
+        AS_NUMBER(args[0]) != (int)AS_NUMBER(args[0])) {
+        runtimeError("Expected a length or a list of numbers.");
+        return false;
+    }
+    int length = (int)AS_NUMBER(args[0]);
+    if (length > (INT32_MAX - (int)sizeof(ObjFloat64Array)) /
+                     (int)sizeof(double)) {
+        runtimeError("Array too large.");
+        return false;
+    }
+    *result = OBJ_VAL(newFloat64Array(length));
+    return true;
+}
+
+// Fetches the Float64Array arguments at the given positions.
+static bool float64Arrays(Value *args, int count, const int *positions,
+                          ObjFloat64Array **arrays) {
+    for (int i = 0; i < count; i++) {
+        Value arg = args[positions[i]];
+        if (!IS_FLOAT64_ARRAY(arg)) {
+            runtimeError("Expected a Float64Array.");
+            return false;
+        }
+        arrays[i] = AS_FLOAT64_ARRAY(arg);
+        if (arrays[i]->length != arrays[0]->length) {
+            runtimeError("Array lengths differ.");
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool numberArg(Value arg, double *number) {
+    if (!IS_NUMBER(arg)) {
+        runtimeError("Expected a number.");
+        return false;
+    }
+    *number = AS_NUMBER(arg);
+    return true;
+}
+
+// f64Add(out, a, b) stores a + b into out and returns it.
+static bool f64AddNative(VM *vm, int argCount, Value *args, Value *result) {
+    static const int positions[] = {0, 1, 2};
+    ObjFloat64Array *arrays[3];
+    if (!float64Arrays(args, 3, positions, arrays)) return false;
+    vectorKernels.add(arrays[0]->values, arrays[1]->values, arrays[2]->values,
+                      arrays[0]->length);
+    *result = args[0];
+    return true;
+}
+
+// f64Mul(out, a, b) stores a * b into out and returns it.
+static bool f64MulNative(VM *vm, int argCount, Value *args, Value *result) {
+    static const int positions[] = {0, 1, 2};
+    ObjFloat64Array *arrays[3];
+    if (!float64Arrays(args, 3, positions, arrays)) return false;
+    vectorKernels.mul(arrays[0]->values, arrays[1]->values, arrays[2]->values,
+                      arrays[0]->length);
+    *result = args[0];
+    return true;
+}
+
+// f64Scale(out, a, factor) stores a * factor into out and returns it.
+static bool f64ScaleNative(VM *vm, int argCount, Value *args, Value *result) {
+    static const int positions[] = {0, 1};
+    ObjFloat64Array *arrays[2];
+    double factor;
+    if (!float64Arrays(args, 2, positions, arrays)) return false;
+    if (!numberArg(args[2], &factor)) return false;
+    vectorKernels.scale(arrays[0]->values, arrays[1]->values, factor,
+                        arrays[0]->length);
+    *result = args[0];
+    return true;
+}
+
+// f64Axpy(alpha, x, y) adds alpha * x to y and returns y.
+static bool f64AxpyNative(VM *vm, int argCount, Value *args, Value *result) {
+    static const int positions[] = {1, 2};
+    ObjFloat64Array *arrays[2];
+    double alpha;
+    if (!numberArg(args[0], &alpha)) return false;
+    if (!float64Arrays(args, 2, positions, arrays)) return false;
+    vectorKernels.axpy(alpha, arrays[0]->values, arrays[1]->values,
+                       arrays[0]->length);
+    *result = args[2];
+    return true;
+}
+
+static bool f64DotNative(VM *vm, int argCount, Value *args, Value *result) {
+    static const int positions[] = {0, 1};
+    ObjFloat64Array *arrays[2];
+    if (!float64Arrays(args, 2, positions, arrays)) return false;
+    *result = NUMBER_VAL(vectorKernels.dot(
+        arrays[0]->values, arrays[1]->values, arrays[0]->length));
+    return true;
+}
+
+static bool f64SumNative(VM *vm, int argCount, Value *args, Value *result) {
+    static const int positions[] = {0};
+    ObjFloat64Array *array;
+    if (!float64Arrays(args, 1, positions, &array)) return false;
+    *result = NUMBER_VAL(vectorKernels.sum(array->values, array->length));
+    return true;
+}
+
+// nil for an empty array.
+static bool f64MinNative(VM *vm, int argCount, Value *args, Value *result) {
+    static const int positions[] = {0};
+    ObjFloat64Array *array;
+    if (!float64Arrays(args, 1, positions, &array)) return false;
+    *result = array->length == 0
+                  ? NIL_VAL
+                  : NUMBER_VAL(vectorKernels.min(array->values, array->length));
+    return true;
+}
+
+// nil for an empty array.
+static bool f64MaxNative(VM *vm, int argCount, Value *args, Value *result) {
+    static const int positions[] = {0};
+    ObjFloat64Array *array;
+    if (!float64Arrays(args, 1, positions, &array)) return false;
+    *result = array->length == 0
+                  ? NIL_VAL
+                  : NUMBER_VAL(vectorKernels.max(array->values, array->length));
+    return true;
+}
+
+static ObjNative *defineNative(const char *name, NativeFn function,
+                               int arity) {
+    push(OBJ_VAL(copyString(name, (int)strlen(name))));
+    push(OBJ_VAL(newNative(function, arity)));
+    ObjNative *native = AS_NATIVE(vm.stack[1]);
+    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    pop();
+    pop();
+    return native;
+}
+
+void defineNatives() {
+    defineNative("clock", clockNative, 0);
+    defineNative("nanoTime", nanoTimeNative, 0);
+    defineNative("cpuTime", cpuTimeNative, 0);
+    defineNative("threadTime", threadTimeNative, 0);
+    defineNative("cycles", cyclesNative, 0);
+    defineNative("bench", benchNative, 2);
+    defineNative("len", lenNative, 1)->intrinsic = OP_LENGTH;
+    defineNative("append", appendNative, 2)->intrinsic = OP_LIST_APPEND;
+    defineNative("has", hasNative, 2);
+    defineNative("remove", removeNative, 2);
+    defineNative("keys", keysNative, 1);
+
+    initVectorKernels();
+    defineNative("Float64Array", float64ArrayNative, 1);
+    defineNative("f64Add", f64AddNative, 3);
+    defineNative("f64Mul", f64MulNative, 3);
+    defineNative("f64Scale", f64ScaleNative, 3);
+    defineNative("f64Axpy", f64AxpyNative, 3);
+    defineNative("f64Dot", f64DotNative, 2);
+    defineNative("f64Sum", f64SumNative, 1);
+    defineNative("f64Min", f64MinNative, 1);
+    defineNative("f64Max", f64MaxNative, 1);
+}
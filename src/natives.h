@@ -0,0 +1,9 @@
+#ifndef clox_natives_h
+#define clox_natives_h
+
+#include "common.h"
+
+// Registers the built in native functions as globals.
+void defineNatives();
+
+#endif
@@ -0,0 +1,890 @@
+#include "optimizer.h"
+
+#include <string.h>
+
+#include "compiler.h"
+#include "ir.h"
+#include "memory.h"
+#include "peephole.h"
+#include "table.h"
+#include "vm.h"
+
+#ifdef DEBUG_PRINT_CODE
+#include "debug.h"
+#endif
+
+typedef enum {
+    // Not worked out yet; loops start out this way.
+    FACT_UNKNOWN,
+    FACT_CONSTANT,
+    FACT_VARYING,
+} FactKind;
+
+typedef struct {
+    FactKind kind;
+    Value value;
+} Fact;
+
+typedef struct {
+    // Global name to the function it keeps for the whole run, or nil when
+    // it is assigned or declared more than once.
+    ValueTable bindings;
+} Optimizer;
+
+typedef bool (*Pass)(Optimizer *optimizer, IrFunction *ir);
+
+// Callees with more code than this aren't inlined.
+#define INLINE_MAX_CODE 32
+
+static Fact constantFact(Value value) { return (Fact){FACT_CONSTANT, value}; }
+
+static Fact unknown() { return (Fact){FACT_UNKNOWN, NIL_VAL}; }
+
+static Fact varying() { return (Fact){FACT_VARYING, NIL_VAL}; }
+
+static bool isFoldable(int op) { return op >= OP_EQUAL && op <= OP_NEGATE; }
+
+static bool isConstantLoad(int op) {
+    return op == OP_CONSTANT || op == OP_NIL || op == OP_TRUE ||
+           op == OP_FALSE;
+}
+
+static bool sameFact(Fact a, Fact b) {
+    if (a.kind != b.kind) return false;
+    if (a.kind != FACT_CONSTANT) return true;
+    if (IS_NUMBER(a.value) && IS_NUMBER(b.value)) {
+        // Bit for bit, so NaN settles and -0 stays apart from 0.
+        double x = AS_NUMBER(a.value);
+        double y = AS_NUMBER(b.value);
+        return IS_INT(a.value) == IS_INT(b.value) &&
+               memcmp(&x, &y, sizeof(double)) == 0;
+    }
+    return valuesEqual(a.value, b.value);
+}
+
+static Fact meet(Fact a, Fact b) {
+    if (a.kind == FACT_UNKNOWN) return b;
+    if (b.kind == FACT_UNKNOWN) return a;
+    return sameFact(a, b) ? a : varying();
+}
+
+static Fact evaluate(const IrFunction *ir, const Fact *facts,
+                     const IrInstruction *instruction) {
+    switch (instruction->op) {
+        case OP_CONSTANT: {
+            Chunk *chunk = &ir->function->chunk;
+            return constantFact(chunk->constants.values[instruction->operand]);
+        }
+        case OP_NIL:
+            return constantFact(NIL_VAL);
+        case OP_TRUE:
+            return constantFact(BOOL_VAL(true));
+        case OP_FALSE:
+            return constantFact(BOOL_VAL(false));
+        case OP_GET_LOCAL: {
+            int source = ir->values[instruction->output].copyOf;
+            return source == -1 ? varying() : facts[source];
+        }
+        default:
+            break;
+    }
+    if (!isFoldable(instruction->op)) return varying();
+
+    Value operands[2] = {NIL_VAL, NIL_VAL};
+    for (int i = 0; i < instruction->inputCount; i++) {
+        Fact fact = facts[ir->inputs[instruction->inputs + i]];
+        if (fact.kind != FACT_CONSTANT) return fact;
+        operands[i] = fact.value;
+    }
+    // Joining strings allocates, so it waits for the code to run.
+    if (instruction->op == OP_ADD && IS_STRING(operands[0]) &&
+        IS_STRING(operands[1])) {
+        return varying();
+    }
+
+    Value result;
+    if (!foldOperation(instruction->op, operands[0], operands[1], &result)) {
+        return varying();
+    }
+    return constantFact(result);
+}
+
+static bool update(Fact *facts, int value, Fact fact) {
+    if (sameFact(facts[value], fact)) return false;
+    facts[value] = fact;
+    return true;
+}
+
+// Works out which values are the same constant however the code gets to
+// them, iterating until loops settle.
+static void findConstants(const IrFunction *ir, Fact *facts) {
+    for (int i = 0; i < ir->valueCount; i++) {
+        facts[i] = unknown();
+    }
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int o = 0; o < ir->orderCount; o++) {
+            int b = ir->order[o];
+            const IrBlock *block = &ir->blocks[b];
+            if (block->params != -1) {
+                for (int j = 0; j < block->depth; j++) {
+                    // What a caller passes in isn't known.
+                    Fact fact = b == 0 ? varying() : unknown();
+                    for (int k = 0; k < block->predecessorCount; k++) {
+                        const IrBlock *from =
+                            &ir->blocks[ir->edges[block->predecessors + k]];
+                        if (from->depth == -1) continue;
+                        fact = meet(fact, facts[ir->stacks[from->exit + j]]);
+                    }
+                    changed |= update(facts, block->params + j, fact);
+                }
+            }
+
+            for (int i = block->start; i < block->end; i++) {
+                const IrInstruction *instruction = &ir->code[i];
+                if (instruction->removed || instruction->output == -1) {
+                    continue;
+                }
+                changed |= update(facts, instruction->output,
+                                  evaluate(ir, facts, instruction));
+            }
+        }
+    }
+}
+
+// A load of a constant that nothing else reads, so it can go along with its
+// only reader.
+static bool isDisposable(const IrFunction *ir, int value) {
+    int def = ir->values[value].def;
+    return def != -1 && !ir->code[def].removed &&
+           isConstantLoad(ir->code[def].op) && ir->values[value].uses == 1;
+}
+
+static void loadConstant(IrFunction *ir, IrInstruction *instruction,
+                         Value value) {
+    if (IS_NIL(value)) {
+        instruction->op = OP_NIL;
+    } else if (IS_BOOL(value)) {
+        instruction->op = AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+    } else {
+        instruction->operand = irConstant(ir, value);
+        instruction->op = OP_CONSTANT;
+    }
+    instruction->inputCount = 0;
+    instruction->pops = 0;
+}
+
+// Replaces reads of locals holding a known constant with the constant,
+// folds operators over constants, and settles branches on them. Returns
+// whether any code changed.
+static bool propagateConstants(Optimizer *optimizer, IrFunction *ir) {
+    Fact *facts = ALLOCATE(Fact, ir->valueCount);
+    findConstants(ir, facts);
+
+    bool changed = false;
+    // Room for a new constant at every instruction, so no load falls short.
+    int constantCount = ir->function->chunk.constants.count;
+    bool room = constantCount + ir->count < MAX_CONSTANTS;
+    for (int i = 0; i < ir->count; i++) {
+        IrInstruction *instruction = &ir->code[i];
+        if (instruction->removed) continue;
+
+        int op = instruction->op;
+        if (op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE) {
+            Fact condition = facts[ir->inputs[instruction->inputs]];
+            if (condition.kind != FACT_CONSTANT) continue;
+            // The condition stays on the stack either way.
+            bool jumps = isFalsey(condition.value) == (op == OP_JUMP_IF_FALSE);
+            if (jumps) {
+                instruction->op = OP_JUMP;
+            } else {
+                instruction->removed = true;
+            }
+            changed = true;
+            continue;
+        }
+
+        if (instruction->output == -1 || isConstantLoad(op)) continue;
+        Fact result = facts[instruction->output];
+        if (result.kind != FACT_CONSTANT || !room) continue;
+        if (op != OP_GET_LOCAL) {
+            if (!isFoldable(op)) continue;
+            bool disposable = true;
+            for (int j = 0; j < instruction->inputCount; j++) {
+                int input = ir->inputs[instruction->inputs + j];
+                disposable &= isDisposable(ir, input);
+            }
+            if (!disposable) continue;
+        }
+
+        // Drops the operands it no longer reads.
+        for (int j = 0; j < instruction->inputCount; j++) {
+            int input = ir->inputs[instruction->inputs + j];
+            ir->code[ir->values[input].def].removed = true;
+        }
+        loadConstant(ir, instruction, result.value);
+        changed = true;
+    }
+
+    FREE_ARRAY(Fact, facts, ir->valueCount);
+    return changed;
+}
+
+static const char *functionName(ObjFunction *function) {
+    ObjString *name = DEREF(ObjString, function->name);
+    return name != NULL ? name->chars : "script";
+}
+
+// Records which globals are declared once, as a function, and never
+// assigned. A global that already exists, as a native does, holds something
+// else until the declaration runs, so it is never bound.
+static bool findBindings(Optimizer *optimizer, IrFunction *ir) {
+    ValueArray *constants = &ir->function->chunk.constants;
+    for (int i = 0; i < ir->count; i++) {
+        IrInstruction *instruction = &ir->code[i];
+        int op = instruction->op;
+        if (instruction->removed ||
+            (op != OP_SET_GLOBAL && op != OP_DEFINE_GLOBAL)) {
+            continue;
+        }
+
+        Value name = constants->values[instruction->operand];
+        if (op == OP_SET_GLOBAL) {
+            valueTableSet(&optimizer->bindings, name, NIL_VAL);
+        } else {
+            Value function = NIL_VAL;
+            Value earlier;
+            int def = ir->values[ir->inputs[instruction->inputs]].def;
+            if (!valueTableGet(&optimizer->bindings, name, &earlier) &&
+                !tableGet(&vm.globals, AS_STRING(name), &earlier) &&
+                def != -1 && ir->code[def].op == OP_CLOSURE) {
+                function = constants->values[ir->code[def].operand];
+            }
+            valueTableSet(&optimizer->bindings, name, function);
+        }
+    }
+    return false;
+}
+
+// The function a call is known to land in: one bound to a global for good,
+// or a closure still held by the local it was declared as.
+static ObjFunction *knownCallee(Optimizer *optimizer, const IrFunction *ir,
+                                const IrInstruction *call) {
+    ValueArray *constants = &ir->function->chunk.constants;
+    int callee = ir->inputs[call->inputs];
+    int def = ir->values[callee].def;
+    if (def == -1) return NULL;
+
+    const IrInstruction *load = &ir->code[def];
+    if (load->op == OP_GET_GLOBAL) {
+        Value function;
+        if (!valueTableGet(&optimizer->bindings,
+                           constants->values[load->operand], &function) ||
+            IS_NIL(function)) {
+            return NULL;
+        }
+        return AS_FUNCTION(function);
+    }
+
+    int source = load->op == OP_GET_LOCAL ? ir->values[callee].copyOf : -1;
+    if (source == -1) return NULL;
+    int closure = ir->values[source].def;
+    if (closure == -1 || (ir->code[closure].op != OP_CLOSURE &&
+                          ir->code[closure].op != OP_FRAME_CLOSURE)) {
+        return NULL;
+    }
+    return AS_FUNCTION(constants->values[ir->code[closure].operand]);
+}
+
+// Whether the body can run on its caller's stack: straight-line code that
+// calls nothing and touches no upvalues or classes.
+static bool isInlinable(const IrFunction *body) {
+    for (int b = 1; b < body->blockCount; b++) {
+        if (body->blocks[b].depth != -1) return false;
+    }
+    const IrBlock *block = &body->blocks[0];
+    for (int i = block->start; i < block->end; i++) {
+        switch (body->code[i].op) {
+            case OP_CONSTANT:
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+            case OP_POP:
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL:
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+            case OP_GET_PROPERTY:
+            case OP_SET_PROPERTY:
+            case OP_BUILD_LIST:
+            case OP_BUILD_MAP:
+            case OP_GET_INDEX:
+            case OP_SET_INDEX:
+            case OP_LIST_APPEND:
+            case OP_LENGTH:
+            case OP_PRINT:
+                break;
+            case OP_RETURN:
+                return i == block->end - 1;
+            default:
+                if (!isFoldable(body->code[i].op)) return false;
+        }
+    }
+    return false;
+}
+
+// Inline frames the body's code is given, keyed by the frame and line it had
+// in the callee; frame -1 stands for the callee itself.
+typedef struct {
+    int frame;
+    int line;
+    int copy;
+} FrameCopy;
+
+typedef struct {
+    IrFunction *ir;
+    ObjFunction *callee;
+    // The call's own frame.
+    int parent;
+    FrameCopy *copies;
+    int count;
+} FrameMap;
+
+static int copyFrame(FrameMap *map, int frame, int line) {
+    for (int i = 0; i < map->count; i++) {
+        if (map->copies[i].frame == frame && map->copies[i].line == line) {
+            return map->copies[i].copy;
+        }
+    }
+
+    int copy;
+    if (frame == -1) {
+        copy = irInlineFrame(map->ir, DEREF(ObjString, map->callee->name), line,
+                             map->parent);
+    } else {
+        InlineFrame *inlined = &map->callee->chunk.inlineFrames[frame];
+        int parent = copyFrame(map, inlined->parent, line);
+        copy = irInlineFrame(map->ir, DEREF(ObjString, inlined->name),
+                             inlined->line, parent);
+    }
+    map->copies[map->count++] = (FrameCopy){frame, line, copy};
+    return copy;
+}
+
+// Lowers the body in place of the call at `index`. The callee and its
+// arguments stay where the call left them, from slot `base` on, and serve as
+// the body's frame; the result then takes the callee's slot.
+static bool inlineCall(IrFunction *ir, int index, ObjFunction *callee,
+                       int base) {
+    if (callee->upvalueCount > 0 || callee->chunk.count > INLINE_MAX_CODE ||
+        ir->function->chunk.constants.count + callee->chunk.constants.count >=
+            MAX_CONSTANTS) {
+        return false;
+    }
+    IrFunction body;
+    if (!irBuild(&body, callee)) return false;
+
+    const IrBlock *block = &body.blocks[0];
+    int depth = 0;
+    for (int i = block->start; i < block->end; i++) {
+        if (body.code[i].depth + 1 > depth) depth = body.code[i].depth + 1;
+    }
+    if (!isInlinable(&body) || base + depth > UINT8_COUNT) {
+        irFree(&body);
+        return false;
+    }
+
+    int line = ir->code[index].line;
+    int count = block->end - block->start + block->exitDepth;
+    IrInstruction *code = ALLOCATE(IrInstruction, count);
+    // Each instruction needs at most its frame and the ones around it.
+    int capacity = (block->end - block->start) *
+                   (callee->chunk.inlineFrameCount + 1);
+    FrameMap frames = {ir, callee, ir->code[index].frame,
+                       ALLOCATE(FrameCopy, capacity), 0};
+    for (int i = 0; i < block->end - block->start; i++) {
+        IrInstruction *instruction = &code[i];
+        *instruction = body.code[block->start + i];
+        instruction->frame =
+            copyFrame(&frames, instruction->frame, instruction->line);
+        instruction->line = line;
+        switch (instruction->op) {
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+                instruction->operand += base;
+                break;
+            case OP_CONSTANT:
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL:
+            case OP_GET_PROPERTY:
+            case OP_SET_PROPERTY: {
+                Value constant =
+                    callee->chunk.constants.values[instruction->operand];
+                instruction->operand = irConstant(ir, constant);
+                break;
+            }
+            case OP_RETURN:
+                instruction->op = OP_SET_LOCAL;
+                instruction->operand = base;
+                break;
+            default:
+                break;
+        }
+    }
+    // What the callee's frame held under the result.
+    for (int i = block->end - block->start; i < count; i++) {
+        code[i] = code[0];
+        code[i].op = OP_POP;
+        code[i].frame = frames.parent;
+    }
+
+    irReplace(ir, index, code, count);
+    FREE_ARRAY(IrInstruction, code, count);
+    FREE_ARRAY(FrameCopy, frames.copies, capacity);
+    irFree(&body);
+    return true;
+}
+
+static bool inlineCalls(Optimizer *optimizer, IrFunction *ir) {
+    bool changed = false;
+    for (int i = 0; i < ir->count; i++) {
+        IrInstruction *call = &ir->code[i];
+        if (call->removed ||
+            (call->op != OP_CALL && call->op != OP_TAIL_CALL)) {
+            continue;
+        }
+
+        ObjFunction *callee = knownCallee(optimizer, ir, call);
+        if (callee == NULL || callee == ir->function ||
+            callee->arity != call->operand) {
+            continue;
+        }
+        if (!inlineCall(ir, i, callee, call->depth - call->inputCount)) {
+            continue;
+        }
+        changed = true;
+        if (compilerOptions.printInlining) {
+            fprintf(stderr, "[line %d] inlined %s() into %s()\n", call->line,
+                    functionName(callee), functionName(ir->function));
+        }
+    }
+    return changed;
+}
+
+// Instructions that may run code the optimizer can't see.
+static bool isCall(int op) {
+    return op == OP_CALL || op == OP_TAIL_CALL || op == OP_CALL_NATIVE ||
+           op == OP_INVOKE || op == OP_SUPER_INVOKE;
+}
+
+// Instructions that can't fail and change nothing, so code hoisted above
+// them still runs in the order it did.
+static bool isQuiet(int op) {
+    return isConstantLoad(op) || op == OP_GET_LOCAL;
+}
+
+typedef struct {
+    int header;
+    // Stack depth on entry to the header; what lies below it outlives the
+    // loop.
+    int depth;
+    // Blocks in the loop.
+    bool *blocks;
+    bool calls;
+    // Each value, or the one it always stands for when it is a block
+    // parameter that is only ever handed a single value.
+    const int *sources;
+    // Instructions in it that assign a global or field, or add a method.
+    int *writes;
+    int writeCount;
+} Loop;
+
+// Marks the blocks of the loop closed by the header's back edges: those that
+// reach one without going through the header.
+static void findLoop(const IrFunction *ir, Loop *loop) {
+    int *work = ALLOCATE(int, ir->blockCount);
+    int count = 0;
+    const IrBlock *header = &ir->blocks[loop->header];
+    loop->blocks[loop->header] = true;
+    for (int i = 0; i < header->predecessorCount; i++) {
+        int from = ir->edges[header->predecessors + i];
+        if (ir->blocks[from].rank == -1 ||
+            !irIsBackEdge(ir, from, loop->header) || loop->blocks[from]) {
+            continue;
+        }
+        loop->blocks[from] = true;
+        work[count++] = from;
+    }
+    while (count > 0) {
+        const IrBlock *block = &ir->blocks[work[--count]];
+        for (int i = 0; i < block->predecessorCount; i++) {
+            int from = ir->edges[block->predecessors + i];
+            if (ir->blocks[from].rank == -1 || loop->blocks[from]) continue;
+            loop->blocks[from] = true;
+            work[count++] = from;
+        }
+    }
+    FREE_ARRAY(int, work, ir->blockCount);
+}
+
+// Whether the loop writes the global or field named by constant `name`.
+static bool writes(const IrFunction *ir, const Loop *loop, int op,
+                   int name) {
+    const ValueArray *constants = &ir->function->chunk.constants;
+    for (int i = 0; i < loop->writeCount; i++) {
+        const IrInstruction *write = &ir->code[loop->writes[i]];
+        if (op == OP_GET_PROPERTY && write->op == OP_METHOD) return true;
+        bool global = write->op == OP_SET_GLOBAL ||
+                      write->op == OP_DEFINE_GLOBAL;
+        if (global != (op == OP_GET_GLOBAL)) continue;
+        if (valuesEqual(constants->values[write->operand],
+                        constants->values[name])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Resolves block parameters that every edge hands the same value, other
+// than the parameter itself coming round a loop, to that value.
+static void findSources(const IrFunction *ir, int *sources) {
+    for (int i = 0; i < ir->valueCount; i++) sources[i] = i;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int b = 0; b < ir->blockCount; b++) {
+            const IrBlock *block = &ir->blocks[b];
+            if (block->params == -1) continue;
+            for (int slot = 0; slot < block->depth; slot++) {
+                int param = block->params + slot;
+                if (sources[param] != param) continue;
+                int source = -1;
+                for (int i = 0; i < block->predecessorCount; i++) {
+                    const IrBlock *from =
+                        &ir->blocks[ir->edges[block->predecessors + i]];
+                    if (from->depth == -1) continue;
+                    int value = sources[ir->stacks[from->exit + slot]];
+                    if (value == param || value == source) continue;
+                    source = source == -1 ? value : -2;
+                }
+                if (source >= 0) {
+                    sources[param] = source;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < ir->valueCount; i++) {
+        while (sources[sources[i]] != sources[i]) {
+            sources[i] = sources[sources[i]];
+        }
+    }
+}
+
+// Whether the header instruction computes the same value on every trip, out
+// of nothing but other such instructions in the header.
+static bool isInvariant(const IrFunction *ir, const Loop *loop,
+                        const bool *invariant, int index) {
+    const IrInstruction *instruction = &ir->code[index];
+    if (instruction->output == -1) return false;
+    for (int i = 0; i < instruction->inputCount; i++) {
+        int def = ir->values[ir->inputs[instruction->inputs + i]].def;
+        if (def == -1 || !invariant[def]) return false;
+    }
+
+    int op = instruction->op;
+    switch (op) {
+        case OP_GET_LOCAL: {
+            // A slot the loop never changes.
+            int copyOf = ir->values[instruction->output].copyOf;
+            return copyOf != -1 &&
+                   !loop->blocks[ir->values[loop->sources[copyOf]].block];
+        }
+        case OP_GET_GLOBAL:
+        case OP_GET_PROPERTY:
+            return !loop->calls && !writes(ir, loop, op, instruction->operand);
+        default:
+            return isConstantLoad(op) || isFoldable(op);
+    }
+}
+
+// Checks the loop can take values pushed ahead of its header: nothing in it
+// refers to its slots other than by GET_LOCAL and SET_LOCAL, it never digs
+// below the header's stack, and every way out of it is a forward edge to a
+// block only the loop leads to. Each such exit gets the instruction where
+// its stack is back down to the header's depth; other blocks get -1.
+static bool canHoist(const IrFunction *ir, Loop *loop, int *exits) {
+    for (int b = 0; b < ir->blockCount; b++) {
+        exits[b] = -1;
+        if (!loop->blocks[b]) continue;
+        const IrBlock *block = &ir->blocks[b];
+        if (block->depth < loop->depth) return false;
+        for (int i = block->start; i < block->end; i++) {
+            const IrInstruction *instruction = &ir->code[i];
+            if (instruction->removed) continue;
+            int op = instruction->op;
+            if (op == OP_CLOSURE || op == OP_FRAME_CLOSURE ||
+                op == OP_CLOSE_UPVALUE ||
+                instruction->depth - instruction->pops < loop->depth) {
+                return false;
+            }
+            if (isCall(op)) loop->calls = true;
+            if (op == OP_SET_GLOBAL || op == OP_DEFINE_GLOBAL ||
+                op == OP_SET_PROPERTY || op == OP_METHOD) {
+                loop->writes[loop->writeCount++] = i;
+            }
+        }
+
+        // Back edges have to jump, so they can skip what is put ahead of
+        // the header.
+        const IrInstruction *last = &ir->code[block->end - 1];
+        for (int i = 0; i < block->successorCount; i++) {
+            int to = block->successors[i];
+            if (to == loop->header && irIsBackEdge(ir, b, to) &&
+                (last->removed || last->target != to)) {
+                return false;
+            }
+        }
+    }
+
+    for (int b = 0; b < ir->blockCount; b++) {
+        if (!loop->blocks[b]) continue;
+        const IrBlock *block = &ir->blocks[b];
+        for (int i = 0; i < block->successorCount; i++) {
+            int to = block->successors[i];
+            if (loop->blocks[to] || exits[to] != -1) continue;
+            if (irIsBackEdge(ir, b, to)) return false;
+
+            const IrBlock *exit = &ir->blocks[to];
+            for (int j = 0; j < exit->predecessorCount; j++) {
+                int from = ir->edges[exit->predecessors + j];
+                if (ir->blocks[from].rank != -1 && !loop->blocks[from]) {
+                    return false;
+                }
+            }
+            for (int j = exit->start; j < exit->end; j++) {
+                const IrInstruction *instruction = &ir->code[j];
+                if (instruction->removed) continue;
+                if (instruction->depth == loop->depth) {
+                    exits[to] = j;
+                    break;
+                }
+                if (instruction->depth < loop->depth) return false;
+            }
+            if (exits[to] == -1) return false;
+        }
+    }
+    return true;
+}
+
+// Moves the slots from the header's depth on up by `count` in code the
+// hoisted values sit under.
+static void shiftSlots(IrFunction *ir, const Loop *loop, int start, int end,
+                       int count) {
+    for (int i = start; i < end; i++) {
+        IrInstruction *instruction = &ir->code[i];
+        if (instruction->removed || instruction->replacementCount > 0) {
+            continue;
+        }
+        if ((instruction->op == OP_GET_LOCAL ||
+             instruction->op == OP_SET_LOCAL) &&
+            instruction->operand >= loop->depth) {
+            instruction->operand += count;
+        }
+    }
+}
+
+// Moves invariant loads and arithmetic in the loop's header to just ahead of
+// it. The header runs first on every way into the loop, so nothing is
+// evaluated that wasn't before, and it keeps its order with everything but
+// the quiet instructions it passes. The values stay on the stack under the
+// loop's own and come off where it is left.
+static int hoistHeader(IrFunction *ir, Loop *loop, bool *invariant) {
+    const IrBlock *header = &ir->blocks[loop->header];
+    int maxDepth = 0;
+    for (int b = 0; b < ir->blockCount; b++) {
+        if (!loop->blocks[b]) continue;
+        for (int i = ir->blocks[b].start; i < ir->blocks[b].end; i++) {
+            if (ir->code[i].depth + 1 > maxDepth) {
+                maxDepth = ir->code[i].depth + 1;
+            }
+        }
+    }
+
+    // Invariant header code up to the first instruction that may fail or
+    // have an effect, other than ones that are invariant themselves.
+    int *consumer = ALLOCATE(int, ir->valueCount);
+    for (int i = 0; i < ir->valueCount; i++) consumer[i] = -1;
+    for (int i = header->start; i < header->end; i++) {
+        const IrInstruction *instruction = &ir->code[i];
+        if (instruction->removed) continue;
+        if (isInvariant(ir, loop, invariant, i)) {
+            invariant[i] = true;
+        } else if (!isQuiet(instruction->op)) {
+            break;
+        }
+        for (int j = 0; j < instruction->inputCount; j++) {
+            consumer[ir->inputs[instruction->inputs + j]] = i;
+        }
+    }
+
+    // Each expression that is worth it goes whole; what it is made of comes
+    // right before it.
+    IrInstruction *hoisted = ALLOCATE(IrInstruction, header->end -
+                                                         header->start);
+    int hoistedCount = 0;
+    int count = 0;
+    for (int i = header->start; i < header->end; i++) {
+        const IrInstruction *root = &ir->code[i];
+        if (!invariant[i]) continue;
+        int output = root->output;
+        if (ir->values[output].uses == 1 && consumer[output] != -1 &&
+            invariant[consumer[output]]) {
+            continue;
+        }
+
+        int start = i;
+        bool whole = true;
+        int need = root->inputCount;
+        while (need > 0 && whole) {
+            start--;
+            const IrInstruction *part = &ir->code[start];
+            if (part->removed) continue;
+            whole = invariant[start] && ir->values[part->output].uses == 1;
+            need += part->inputCount - 1;
+        }
+        // What stays behind keeps its place after what goes.
+        if (!whole || maxDepth + count + 1 > UINT8_COUNT) break;
+        bool worth = false;
+        for (int j = start; j <= i; j++) {
+            if (!ir->code[j].removed && !isQuiet(ir->code[j].op)) worth = true;
+        }
+        if (!worth) continue;
+
+        for (int j = start; j <= i; j++) {
+            if (ir->code[j].removed) continue;
+            hoisted[hoistedCount++] = ir->code[j];
+            if (j < i) ir->code[j].removed = true;
+        }
+        IrInstruction load = *root;
+        load.op = OP_GET_LOCAL;
+        load.operand = loop->depth + count++;
+        irReplace(ir, i, &load, 1);
+    }
+    FREE_ARRAY(int, consumer, ir->valueCount);
+
+    if (count > 0) {
+        irInsert(ir, header->start, hoisted, hoistedCount);
+    }
+    FREE_ARRAY(IrInstruction, hoisted, header->end - header->start);
+    return count;
+}
+
+static bool hoistInvariants(Optimizer *optimizer, IrFunction *ir) {
+    bool *invariant = ALLOCATE(bool, ir->count);
+    int *exits = ALLOCATE(int, ir->blockCount);
+    int *sources = ALLOCATE(int, ir->valueCount);
+    findSources(ir, sources);
+    Loop loop;
+    loop.sources = sources;
+    loop.blocks = ALLOCATE(bool, ir->blockCount);
+    loop.writes = ALLOCATE(int, ir->count);
+
+    // One loop at a time: the next one is found in the code that results.
+    bool changed = false;
+    for (int i = 0; i < ir->orderCount && !changed; i++) {
+        int header = ir->order[i];
+        bool loops = false;
+        for (int j = 0; j < ir->blocks[header].predecessorCount; j++) {
+            int from = ir->edges[ir->blocks[header].predecessors + j];
+            loops |= ir->blocks[from].rank != -1 &&
+                     irIsBackEdge(ir, from, header);
+        }
+        if (!loops) continue;
+
+        loop.header = header;
+        loop.depth = ir->blocks[header].depth;
+        loop.calls = false;
+        loop.writeCount = 0;
+        memset(loop.blocks, 0, sizeof(bool) * ir->blockCount);
+        memset(invariant, 0, sizeof(bool) * ir->count);
+        findLoop(ir, &loop);
+        if (!canHoist(ir, &loop, exits)) continue;
+
+        int count = hoistHeader(ir, &loop, invariant);
+        if (count == 0) continue;
+        changed = true;
+        for (int b = 0; b < ir->blockCount; b++) {
+            const IrBlock *block = &ir->blocks[b];
+            if (loop.blocks[b]) {
+                shiftSlots(ir, &loop, block->start, block->end, count);
+            } else if (exits[b] != -1) {
+                shiftSlots(ir, &loop, block->start, exits[b], count);
+                IrInstruction pop = ir->code[exits[b]];
+                pop.op = OP_POP;
+                pop.captures = NULL;
+                IrInstruction *pops = ALLOCATE(IrInstruction, count);
+                for (int j = 0; j < count; j++) pops[j] = pop;
+                irInsert(ir, exits[b], pops, count);
+                FREE_ARRAY(IrInstruction, pops, count);
+            }
+        }
+    }
+
+    FREE_ARRAY(int, loop.writes, ir->count);
+    FREE_ARRAY(bool, loop.blocks, ir->blockCount);
+    FREE_ARRAY(int, sources, ir->valueCount);
+    FREE_ARRAY(int, exits, ir->blockCount);
+    FREE_ARRAY(bool, invariant, ir->count);
+    return changed;
+}
+
+#ifdef DEBUG_PRINT_CODE
+static bool printFunction(Optimizer *optimizer, IrFunction *ir) {
+    irPrint(ir, functionName(ir->function));
+    disassembleChunk(&ir->function->chunk, functionName(ir->function));
+    return false;
+}
+#endif
+
+// Runs `pass` over the function and every one nested in it, innermost
+// first, and lowers the code wherever it changed. Returns whether any did.
+static bool runPass(Optimizer *optimizer, ObjFunction *function, Pass pass) {
+    Chunk *chunk = &function->chunk;
+    bool changed = false;
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value constant = chunk->constants.values[i];
+        if (IS_FUNCTION(constant)) {
+            changed |= runPass(optimizer, AS_FUNCTION(constant), pass);
+        }
+    }
+
+    IrFunction ir;
+    if (!irBuild(&ir, function)) return changed;
+    if (pass(optimizer, &ir) && irLower(&ir)) {
+        if (compilerOptions.peephole) peepholeChunk(chunk);
+        changed = true;
+    }
+    irFree(&ir);
+    return changed;
+}
+
+void optimizeProgram(ObjFunction *script) {
+    Optimizer optimizer;
+    initValueTable(&optimizer.bindings);
+    runPass(&optimizer, script, propagateConstants);
+    runPass(&optimizer, script, findBindings);
+    // Constants passed in can now be folded into the inlined bodies.
+    runPass(&optimizer, script, inlineCalls);
+    runPass(&optimizer, script, propagateConstants);
+    // Calls inlined above no longer keep loads in their loops.
+    while (runPass(&optimizer, script, hoistInvariants)) {
+    }
+    freeValueTable(&optimizer.bindings);
+
+#ifdef DEBUG_PRINT_CODE
+    runPass(&optimizer, script, printFunction);
+#endif
+}
@@ -0,0 +1,11 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "value.h"
+
+// Runs the middle end over a compiled script and every function nested in
+// it: each is lifted to IR, rewritten by the passes and lowered back to
+// bytecode. The passes assume they see the whole program.
+void optimizeProgram(ObjFunction *script);
+
+#endif
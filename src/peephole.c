@@ -0,0 +1,271 @@
+#include "peephole.h"
+
+#include <string.h>
+
+#include "memory.h"
+
+typedef struct {
+    int offset;
+    int length;
+    int line;
+    // Index of the instruction a jump lands on, -1 for anything else.
+    int target;
+    bool keep;
+} Instruction;
+
+typedef struct {
+    Chunk *chunk;
+    // The code decoded, plus a last entry standing for the end of the chunk.
+    Instruction *code;
+    int count;
+    // Kept jumps landing on each instruction.
+    int *jumpsTo;
+} Program;
+
+// Jumps longer than this are left alone; they include ones going in circles.
+#define MAX_JUMP_THREAD 16
+
+// The opcode at `index`, or -1 at the end of the chunk.
+static int opAt(const Program *program, int index) {
+    if (index == program->count) return -1;
+    return program->chunk->code[program->code[index].offset];
+}
+
+static bool isJump(int op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE ||
+           op == OP_LOOP;
+}
+
+static bool isUnconditional(int op) {
+    return op == OP_JUMP || op == OP_LOOP;
+}
+
+// Pushes a value and can have no other effect.
+static bool isPurePush(const Program *program, int index) {
+    const uint8_t *code = &program->chunk->code[program->code[index].offset];
+    switch (code[0]) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_GET_OUTER_LOCAL:
+            return true;
+        case OP_WIDE:
+            return code[3] == OP_CONSTANT;
+        default:
+            return false;
+    }
+}
+
+// The first instruction still kept at or after `index`.
+static int resolve(const Program *program, int index) {
+    while (!program->code[index].keep) index++;
+    return index;
+}
+
+static int nextKept(const Program *program, int index) {
+    return resolve(program, index + 1);
+}
+
+static void decode(Program *program, Chunk *chunk) {
+    program->chunk = chunk;
+    program->count = 0;
+    int *indexAt = ALLOCATE(int, chunk->count + 1);
+    int *lineAt = ALLOCATE(int, chunk->count);
+    getLines(&chunk->lines, lineAt, chunk->count);
+
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk, offset)) {
+        indexAt[offset] = program->count++;
+    }
+    indexAt[chunk->count] = program->count;
+
+    program->code = ALLOCATE(Instruction, program->count + 1);
+    program->jumpsTo = ALLOCATE(int, program->count + 1);
+    for (int offset = 0, i = 0; i <= program->count; i++) {
+        Instruction *instruction = &program->code[i];
+        instruction->offset = offset;
+        instruction->keep = true;
+        instruction->target = -1;
+        if (i == program->count) {
+            instruction->length = 0;
+            instruction->line = 0;
+            break;
+        }
+
+        const uint8_t *code = &chunk->code[offset];
+        instruction->length = instructionLength(chunk, offset);
+        instruction->line = lineAt[offset];
+        if (isJump(code[0])) {
+            int jump = (code[1] << 8) | code[2];
+            int to = code[0] == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+            instruction->target = indexAt[to];
+        }
+        offset += instruction->length;
+    }
+
+    FREE_ARRAY(int, lineAt, chunk->count);
+    FREE_ARRAY(int, indexAt, chunk->count + 1);
+}
+
+static void countJumps(Program *program) {
+    memset(program->jumpsTo, 0, sizeof(int) * (program->count + 1));
+    for (int i = 0; i < program->count; i++) {
+        Instruction *instruction = &program->code[i];
+        if (instruction->keep && instruction->target != -1) {
+            program->jumpsTo[resolve(program, instruction->target)]++;
+        }
+    }
+}
+
+// Where a jump from `index` ends up once it follows the jumps it lands on.
+static int threadJump(const Program *program, int index) {
+    int op = opAt(program, index);
+    int target = resolve(program, program->code[index].target);
+    for (int hops = 0;; hops++) {
+        int next = opAt(program, target);
+        // A conditional jump leaves its value on the stack, so one of the
+        // same kind would jump again.
+        if (!isUnconditional(next) && next != op) break;
+        if (hops == MAX_JUMP_THREAD) return program->code[index].target;
+        target = resolve(program, program->code[target].target);
+    }
+
+    // Operands are 16 bits, and conditional jumps only go forward.
+    int distance = program->code[target].offset - program->code[index].offset;
+    if (distance < 0) distance = -distance;
+    if (distance > UINT16_MAX - 3) return program->code[index].target;
+    if (!isUnconditional(op) && target <= index) {
+        return program->code[index].target;
+    }
+    return target;
+}
+
+static bool simplify(Program *program) {
+    Chunk *chunk = program->chunk;
+    bool changed = false;
+    bool reachable = true;
+    countJumps(program);
+
+    for (int i = 0; i < program->count; i++) {
+        Instruction *instruction = &program->code[i];
+        if (!instruction->keep) continue;
+        if (program->jumpsTo[i] > 0) reachable = true;
+        if (!reachable) {
+            instruction->keep = false;
+            changed = true;
+            continue;
+        }
+
+        int op = opAt(program, i);
+        int next = nextKept(program, i);
+        if (isJump(op)) {
+            int target = threadJump(program, i);
+            if (target != resolve(program, instruction->target)) {
+                instruction->target = target;
+                changed = true;
+            }
+            if (op == OP_JUMP && target == next) {
+                instruction->keep = false;
+                changed = true;
+            }
+        } else if (op == OP_NOT && program->jumpsTo[next] == 0) {
+            // The condition is popped on both paths, so nothing sees it
+            // wasn't negated.
+            int jump = opAt(program, next);
+            if ((jump == OP_JUMP_IF_FALSE || jump == OP_JUMP_IF_TRUE) &&
+                opAt(program, nextKept(program, next)) == OP_POP &&
+                opAt(program, resolve(program, program->code[next].target)) ==
+                    OP_POP) {
+                chunk->code[program->code[next].offset] =
+                    jump == OP_JUMP_IF_FALSE ? OP_JUMP_IF_TRUE
+                                             : OP_JUMP_IF_FALSE;
+                instruction->keep = false;
+                changed = true;
+            }
+        } else if (isPurePush(program, i) && opAt(program, next) == OP_POP &&
+                   program->jumpsTo[next] == 0) {
+            instruction->keep = false;
+            program->code[next].keep = false;
+            changed = true;
+            continue;
+        }
+
+        if (instruction->keep &&
+            (op == OP_RETURN || isUnconditional(op))) {
+            reachable = false;
+        }
+    }
+    return changed;
+}
+
+// The instruction starting at `offset`.
+static int indexOf(const Program *program, int offset) {
+    int low = 0;
+    int high = program->count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (program->code[middle].offset < offset) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Packs the kept instructions to the front and re-encodes jumps, lines and
+// inline frame runs.
+static void layout(Program *program) {
+    Chunk *chunk = program->chunk;
+    int *newOffset = ALLOCATE(int, program->count + 1);
+    int count = 0;
+    for (int i = 0; i <= program->count; i++) {
+        newOffset[i] = count;
+        if (program->code[i].keep) count += program->code[i].length;
+    }
+
+    Lines lines;
+    initLines(&lines);
+    for (int i = 0; i < program->count; i++) {
+        Instruction *instruction = &program->code[i];
+        if (!instruction->keep) continue;
+
+        uint8_t *code = &chunk->code[newOffset[i]];
+        memmove(code, &chunk->code[instruction->offset], instruction->length);
+        for (int byte = 0; byte < instruction->length; byte++) {
+            writeLines(&lines, newOffset[i] + byte, instruction->line);
+        }
+        if (instruction->target == -1) continue;
+
+        int to = newOffset[resolve(program, instruction->target)];
+        int from = newOffset[i] + 3;
+        if (isUnconditional(code[0])) code[0] = to >= from ? OP_JUMP : OP_LOOP;
+        int jump = to >= from ? to - from : from - to;
+        code[1] = (jump >> 8) & 0xff;
+        code[2] = jump & 0xff;
+    }
+
+    for (int i = 0; i < chunk->inlineRunCount; i++) {
+        InlineRun *run = &chunk->inlineRuns[i];
+        run->start = newOffset[resolve(program, indexOf(program, run->start))];
+    }
+
+    freeLines(&chunk->lines);
+    chunk->lines = lines;
+    chunk->count = count;
+    FREE_ARRAY(int, newOffset, program->count + 1);
+}
+
+void peepholeChunk(Chunk *chunk) {
+    Program program;
+    decode(&program, chunk);
+    bool changed = false;
+    while (simplify(&program)) changed = true;
+    if (changed) layout(&program);
+
+    FREE_ARRAY(Instruction, program.code, program.count + 1);
+    FREE_ARRAY(int, program.jumpsTo, program.count + 1);
+}
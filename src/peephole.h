@@ -0,0 +1,12 @@
+#ifndef clox_peephole_h
+#define clox_peephole_h
+
+#include "chunk.h"
+
+// Rewrites a finished chunk in place: drops pushes that are popped right
+// away and code that can't be reached, threads jumps that land on jumps, and
+// folds OP_NOT into the conditional jump after it. Jump offsets and line info
+// are kept in step with the code.
+void peepholeChunk(Chunk *chunk);
+
+#endif
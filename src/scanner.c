@@ -212,8 +212,14 @@ Token scanToken() {
             return makeToken(TOKEN_LEFT_BRACE);
         case '}':
             return makeToken(TOKEN_RIGHT_BRACE);
+        case '[':
+            return makeToken(TOKEN_LEFT_BRACKET);
+        case ']':
+            return makeToken(TOKEN_RIGHT_BRACKET);
         case ';':
             return makeToken(TOKEN_SEMICOLON);
+        case ':':
+            return makeToken(TOKEN_COLON);
         case ',':
             return makeToken(TOKEN_COMMA);
         case '.':
@@ -257,6 +263,15 @@ const char* getTokenTypeName(TokenType tokenType) {
         case TOKEN_RIGHT_BRACE:
             name = "TOKEN_RIGHT_BRACE";
             break;
+        case TOKEN_LEFT_BRACKET:
+            name = "TOKEN_LEFT_BRACKET";
+            break;
+        case TOKEN_RIGHT_BRACKET:
+            name = "TOKEN_RIGHT_BRACKET";
+            break;
+        case TOKEN_COLON:
+            name = "TOKEN_COLON";
+            break;
         case TOKEN_COMMA:
             name = "TOKEN_COMMA";
             break;
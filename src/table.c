@@ -146,4 +146,179 @@ void markTable(Table* table) {
         markObject((Obj*)entry->key);
         markValue(entry->value);
     }
-}
\ No newline at end of file
+}
+void initValueTable(ValueTable* table) {
+    table->count = 0;
+    table->capacity = 0;
+    table->entries = NULL;
+    table->size = 0;
+    table->hasNilKey = false;
+    table->nilValue = NIL_VAL;
+}
+
+void freeValueTable(ValueTable* table) {
+    FREE_ARRAY(ValueEntry, table->entries, table->capacity);
+    initValueTable(table);
+}
+
+#ifdef NAN_BOXING
+// Canonical keys are equal exactly when their bits are.
+#define KEYS_EQUAL(a, b) ((a) == (b))
+#else
+#define KEYS_EQUAL(a, b) valuesEqual(a, b)
+#endif
+
+static uint32_t hashKey(Value key) {
+    if (IS_OBJ(key)) return AS_STRING(key)->hash;
+
+#ifdef NAN_BOXING
+    uint64_t bits = key;
+#else
+    uint64_t bits = 0;
+    if (IS_NUMBER(key)) {
+        double number = AS_NUMBER(key);
+        memcpy(&bits, &number, sizeof(bits));
+    } else if (IS_BOOL(key)) {
+        bits = AS_BOOL(key) ? 3 : 2;
+    }
+#endif
+    // Spread sequential ints over the table.
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+static ValueEntry* findValueEntry(ValueEntry* entries, int capacity,
+                                  Value key) {
+    const uint32_t mask = capacity - 1;
+    uint32_t index = hashKey(key) & mask;
+    ValueEntry* tombstone = NULL;
+
+    for (;;) {
+        ValueEntry* entry = &entries[index];
+        if (IS_NIL(entry->key)) {
+            if (IS_NIL(entry->value)) {
+                return tombstone != NULL ? tombstone : entry;
+            } else {
+                if (tombstone == NULL) tombstone = entry;
+            }
+        } else if (KEYS_EQUAL(entry->key, key)) {
+            return entry;
+        }
+        index = (index + 1) & mask;
+    }
+}
+
+bool valueTableGet(ValueTable* table, Value key, Value* value) {
+    if (IS_NIL(key)) {
+        *value = table->nilValue;
+        return table->hasNilKey;
+    }
+    if (table->count == 0) return false;
+
+    ValueEntry* entry = findValueEntry(table->entries, table->capacity, key);
+    if (IS_NIL(entry->key)) return false;
+
+    *value = entry->value;
+    return true;
+}
+
+static void adjustValueCapacity(ValueTable* table, int capacity) {
+    ValueEntry* entries = ALLOCATE(ValueEntry, capacity);
+    for (int i = 0; i < capacity; i++) {
+        entries[i].key = NIL_VAL;
+        entries[i].value = NIL_VAL;
+    }
+
+    table->count = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        ValueEntry* entry = &table->entries[i];
+        if (IS_NIL(entry->key)) continue;
+
+        ValueEntry* dest = findValueEntry(entries, capacity, entry->key);
+        dest->key = entry->key;
+        dest->value = entry->value;
+        table->count++;
+    }
+
+    FREE_ARRAY(ValueEntry, table->entries, table->capacity);
+    table->entries = entries;
+    table->capacity = capacity;
+}
+
+bool valueTableSet(ValueTable* table, Value key, Value value) {
+    if (IS_NIL(key)) {
+        bool isNewKey = !table->hasNilKey;
+        if (isNewKey) table->size++;
+        table->hasNilKey = true;
+        table->nilValue = value;
+        return isNewKey;
+    }
+
+    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
+        int capacity = GROW_CAPACITY(table->capacity);
+        adjustValueCapacity(table, capacity);
+    }
+
+    ValueEntry* entry = findValueEntry(table->entries, table->capacity, key);
+    bool isNewKey = IS_NIL(entry->key);
+    if (isNewKey && IS_NIL(entry->value)) table->count++;
+    if (isNewKey) table->size++;
+
+    entry->key = key;
+    entry->value = value;
+    return isNewKey;
+}
+
+bool valueTableDelete(ValueTable* table, Value key) {
+    if (IS_NIL(key)) {
+        if (!table->hasNilKey) return false;
+        table->size--;
+        table->hasNilKey = false;
+        table->nilValue = NIL_VAL;
+        return true;
+    }
+    if (table->count == 0) return false;
+
+    ValueEntry* entry = findValueEntry(table->entries, table->capacity, key);
+    if (IS_NIL(entry->key)) return false;
+
+    table->size--;
+    entry->key = NIL_VAL;
+    entry->value = BOOL_VAL(true);
+    return true;
+}
+
+bool valueTableNext(ValueTable* table, int* cursor, Value* key,
+                    Value* value) {
+    // Position 0 is the nil key, entries[i] is at position i + 1.
+    if (*cursor == 0) {
+        (*cursor)++;
+        if (table->hasNilKey) {
+            *key = NIL_VAL;
+            *value = table->nilValue;
+            return true;
+        }
+    }
+
+    while (*cursor <= table->capacity) {
+        ValueEntry* entry = &table->entries[*cursor - 1];
+        (*cursor)++;
+        if (IS_NIL(entry->key)) continue;
+
+        *key = entry->key;
+        *value = entry->value;
+        return true;
+    }
+    return false;
+}
+
+void markValueTable(ValueTable* table) {
+    markValue(table->nilValue);
+    for (int i = 0; i < table->capacity; i++) {
+        ValueEntry* entry = &table->entries[i];
+        markValue(entry->key);
+        markValue(entry->value);
+    }
+}
@@ -4,16 +4,23 @@
 #include "common.h"
 #include "value.h"
 
-typedef struct {
+typedef struct Entry {
     ObjString* key;
     Value value;
 } Entry;
 
-typedef struct {
-    int count;
-    int capacity;
-    Entry* entries;
-} Table;
+// struct Table is laid out in value.h, embedded into ObjClass/ObjInstance.
+typedef struct Table Table;
+
+typedef struct ValueEntry {
+    Value key;
+    Value value;
+} ValueEntry;
+
+// struct ValueTable is laid out in value.h, embedded into ObjMap. Keys are
+// numbers, strings, bools or nil, canonicalized by the caller: ints for
+// integral numbers, flat strings for ropes.
+typedef struct ValueTable ValueTable;
 
 void initTable(Table* table);
 void freeTable(Table* table);
@@ -28,4 +35,14 @@ ObjString* tableFindString(Table* table, const char* chars, int length,
 void tableRemoveWhite(Table* table);
 void markTable(Table* table);
 
+void initValueTable(ValueTable* table);
+void freeValueTable(ValueTable* table);
+bool valueTableGet(ValueTable* table, Value key, Value* value);
+bool valueTableSet(ValueTable* table, Value key, Value value);
+bool valueTableDelete(ValueTable* table, Value key);
+// Steps *cursor, which starts at 0, to the next key and skips tombstones.
+// False once every key has been seen.
+bool valueTableNext(ValueTable* table, int* cursor, Value* key, Value* value);
+void markValueTable(ValueTable* table);
+
 #endif
\ No newline at end of file
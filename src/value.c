@@ -15,10 +15,13 @@ void initValueArray(ValueArray* valueArray) {
 
 void writeValueArray(ValueArray* valueArray, Value value) {
     if (valueArray->capacity < valueArray->count + 1) {
+        // The capacity changes only once the memory is there, as an
+        // allocation can fail and unwind out of here.
         int oldCapacity = valueArray->capacity;
-        valueArray->capacity = GROW_CAPACITY(oldCapacity);
-        valueArray->values = GROW_ARRAY(Value, valueArray->values, oldCapacity,
-                                        valueArray->capacity);
+        int capacity = GROW_CAPACITY(oldCapacity);
+        valueArray->values =
+            GROW_ARRAY(Value, valueArray->values, oldCapacity, capacity);
+        valueArray->capacity = capacity;
     }
 
     valueArray->values[valueArray->count++] = value;
@@ -35,12 +38,20 @@ const char* objTypeToString(ObjType type) {
             return "OBJ_BOUND_METHOD";
         case OBJ_CLASS:
             return "OBJ_CLASS";
+        case OBJ_FLOAT64_ARRAY:
+            return "OBJ_FLOAT64_ARRAY";
         case OBJ_FUNCTION:
             return "OBJ_FUNCTION";
         case OBJ_INSTANCE:
             return "OBJ_INSTANCE";
+        case OBJ_LIST:
+            return "OBJ_LIST";
+        case OBJ_MAP:
+            return "OBJ_MAP";
         case OBJ_NATIVE:
             return "OBJ_NATIVE";
+        case OBJ_ROPE:
+            return "OBJ_ROPE";
         case OBJ_STRING:
             return "OBJ_STRING";
         case OBJ_UPVALUE:
@@ -48,29 +59,112 @@ const char* objTypeToString(ObjType type) {
         case OBJ_CLOSURE:
             return "OBJ_CLOSURE";
     }
+    return "OBJ_UNKNOWN";
 }
 
 static void printFunction(ObjFunction* function) {
-    if (function->name == NULL) {
+    ObjString* name = DEREF(ObjString, function->name);
+    if (name == NULL) {
         printf("<script>");
         return;
     }
 
-    printf("<fn %s>", function->name->chars);
+    printf("<fn %s>", name->chars);
+}
+
+static void printFloat64Array(ObjFloat64Array* array) {
+    printf("Float64Array([");
+    for (int i = 0; i < array->length; i++) {
+        if (i > 0) printf(", ");
+        printf("%g", array->values[i]);
+    }
+    printf("])");
+}
+
+// Lists and maps being printed, outermost first. One met again inside
+// itself prints as a placeholder, and so does anything nested deeper than
+// PRINT_DEPTH_MAX, so printing can't run the C stack out.
+#define PRINT_DEPTH_MAX 256
+static Obj* printing[PRINT_DEPTH_MAX];
+static int printingCount = 0;
+
+static bool startPrinting(Obj* object) {
+    if (printingCount == PRINT_DEPTH_MAX) return false;
+    for (int i = 0; i < printingCount; i++) {
+        if (printing[i] == object) return false;
+    }
+    printing[printingCount++] = object;
+    return true;
+}
+
+static void printList(ObjList* list) {
+    if (!startPrinting((Obj*)list)) {
+        printf("[...]");
+        return;
+    }
+    printf("[");
+    for (int i = 0; i < list->items.count; i++) {
+        if (i > 0) printf(", ");
+        printValue(list->items.values[i]);
+    }
+    printf("]");
+    printingCount--;
+}
+
+static void printMap(ObjMap* map) {
+    if (!startPrinting((Obj*)map)) {
+        printf("{...}");
+        return;
+    }
+    printf("{");
+    int cursor = 0;
+    Value key, value;
+    for (int i = 0; valueTableNext((ValueTable*)&map->table, &cursor, &key,
+                                   &value);
+         i++) {
+        if (i > 0) printf(", ");
+        printValue(key);
+        printf(": ");
+        printValue(value);
+    }
+    printf("}");
+    printingCount--;
+}
+
+static void printRope(Value node) {
+    if (!IS_ROPE(node)) {
+        printValue(node);
+        return;
+    }
+
+    ObjRope* rope = AS_ROPE(node);
+    ObjString* flat = DEREF(ObjString, rope->flat);
+    if (flat != NULL) {
+        printf("%s", flat->chars);
+        return;
+    }
+    printRope(rope->left);
+    printRope(rope->right);
 }
 
 void printObject(Value value) {
     switch (OBJ_TYPE(value)) {
         case OBJ_BOUND_METHOD:
-            printFunction(AS_BOUND_METHOD(value)->method->function);
+            printFunction(DEREF(
+                ObjFunction,
+                DEREF(ObjClosure, AS_BOUND_METHOD(value)->method)->function));
             break;
 
         case OBJ_CLASS:
-            printf("%s", AS_CLASS(value)->name->chars);
+            printf("%s", DEREF(ObjString, AS_CLASS(value)->name)->chars);
             break;
 
         case OBJ_CLOSURE:
-            printFunction(AS_CLOSURE(value)->function);
+            printFunction(DEREF(ObjFunction, AS_CLOSURE(value)->function));
+            break;
+
+        case OBJ_FLOAT64_ARRAY:
+            printFloat64Array(AS_FLOAT64_ARRAY(value));
             break;
 
         case OBJ_FUNCTION:
@@ -78,13 +172,28 @@ void printObject(Value value) {
             break;
 
         case OBJ_INSTANCE:
-            printf("%s instance", AS_INSTANCE(value)->klass->name->chars);
+            printf("%s instance",
+                   DEREF(ObjString,
+                         DEREF(ObjClass, AS_INSTANCE(value)->klass)->name)
+                       ->chars);
+            break;
+
+        case OBJ_LIST:
+            printList(AS_LIST(value));
+            break;
+
+        case OBJ_MAP:
+            printMap(AS_MAP(value));
             break;
 
         case OBJ_NATIVE:
             printf("<native fn>");
             break;
 
+        case OBJ_ROPE:
+            printRope(value);
+            break;
+
         case OBJ_STRING:
             printf("%s", AS_CSTRING(value));
             break;
@@ -105,6 +214,10 @@ void printValue(Value value) {
         printf("%g", AS_NUMBER(value));
     } else if (IS_OBJ(value)) {
         printObject(value);
+    } else if (IS_SHORT_STRING(value)) {
+        char chars[SHORT_STRING_MAX + 1];
+        shortStringChars(value, chars);
+        printf("%s", chars);
     }
 #else
     switch (value.type) {
@@ -134,9 +247,12 @@ void printDebugObjectHeader(const char* message, Obj* object) {
 
 bool valuesEqual(Value a, Value b) {
 #ifdef NAN_BOXING
+    if (IS_INT(a) && IS_INT(b)) return a == b;
     if (IS_NUMBER(a) && IS_NUMBER(b)) {
         return AS_NUMBER(a) == AS_NUMBER(b);
     }
+    // Strings that fit are always immediate and longer ones are interned, so
+    // bitwise equality covers both string representations.
     return a == b;
 #else
     if (a.type != b.type) return false;
@@ -159,12 +275,10 @@ bool valuesEqual(Value a, Value b) {
 }
 
 static Obj* allocateObject(size_t size, ObjType type) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
-    object->type = type;
+    Obj* object = (Obj*)reallocateObject(NULL, 0, size);
+    object->type = (uint8_t)type;
     object->isMarked = false;
-
-    object->next = (struct Obj*)vm.objects;
-    vm.objects = object;
+    object->age = 0;
 #ifdef DEBUG_LOG_GC
     printf("%p allocate %zu for %s\n", (void*)object, size,
            objTypeToString(type));
@@ -178,27 +292,25 @@ static Obj* allocateObject(size_t size, ObjType type) {
 ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
     ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
     bound->receiver = receiver;
-    bound->method = method;
+    bound->method = REF(method);
     return bound;
 }
 
 ObjClass* newClass(ObjString* name) {
     ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
-    klass->name = name;
+    klass->name = REF(name);
     initTable((Table*)&klass->methods);
     return klass;
 }
 
 ObjClosure* newClosure(ObjFunction* function) {
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
+    ObjClosure* closure = (ObjClosure*)allocateObject(
+        closureSize(function->upvalueCount), OBJ_CLOSURE);
+    closure->function = REF(function);
+    closure->upvalueCount = function->upvalueCount;
     for (int i = 0; i < function->upvalueCount; i++) {
-        upvalues[i] = NULL;
+        closure->upvalues[i] = REF(NULL);
     }
-
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
-    closure->function = function;
-    closure->upvalues = upvalues;
-    closure->upvalueCount = function->upvalueCount;
     return closure;
 }
 
@@ -206,24 +318,113 @@ ObjFunction* newFunction() {
     ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
-    function->name = NULL;
+    function->readsEnclosingFrame = false;
+    function->name = REF(NULL);
     initChunk((Chunk*)&function->chunk);
     return function;
 }
 
 ObjInstance* newInstance(ObjClass* klass) {
     ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
-    instance->klass = klass;
+    instance->klass = REF(klass);
     initTable((Table*)&instance->fields);
     return instance;
 }
 
-ObjNative* newNative(NativeFn function) {
+// Zero filled.
+ObjFloat64Array* newFloat64Array(int length) {
+    ObjFloat64Array* array = (ObjFloat64Array*)allocateObject(
+        float64ArraySize(length), OBJ_FLOAT64_ARRAY);
+    array->length = length;
+    memset(array->values, 0, sizeof(double) * length);
+    return array;
+}
+
+ObjList* newList() {
+    ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+    initValueArray(&list->items);
+    return list;
+}
+
+ObjMap* newMap() {
+    ObjMap* map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
+    initValueTable((ValueTable*)&map->table);
+    return map;
+}
+
+ObjNative* newNative(NativeFn function, int arity) {
     ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function = function;
+    native->arity = arity;
+    native->intrinsic = -1;
     return native;
 }
 
+ObjRope* newRope(Value left, Value right, int length) {
+    ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->length = length;
+    rope->left = left;
+    rope->right = right;
+    rope->flat = REF(NULL);
+    return rope;
+}
+
+// The rope must be reachable (e.g. on the VM stack); flattening allocates.
+ObjString* flattenRope(ObjRope* rope) {
+    if (rope->flat != REF(NULL)) return DEREF(ObjString, rope->flat);
+
+    // Allocate up front; nothing below allocates until internString().
+    ObjString* result = makeString(rope->length);
+    char* chars = result->chars;
+
+    // `s = s + x` loops build left-deep ropes, so walk them with an explicit
+    // stack of pending nodes instead of recursing.
+    int nodeCount = 0;
+    int nodeCapacity = 0;
+    Value* nodes = NULL;
+    Value node = OBJ_VAL(rope);
+    int offset = 0;
+    for (;;) {
+        if (IS_SHORT_STRING(node)) {
+            shortStringChars(node, chars + offset);
+            offset += SHORT_STRING_LENGTH(node);
+        } else if (IS_ROPE(node) && AS_ROPE(node)->flat == REF(NULL)) {
+            if (nodeCapacity < nodeCount + 1) {
+                nodeCapacity = GROW_CAPACITY(nodeCapacity);
+                Value* grown =
+                    (Value*)realloc(nodes, sizeof(Value) * nodeCapacity);
+                if (grown == NULL) {
+                    // The unfinished result is unreachable garbage, and
+                    // the rope is left as it was.
+                    free(nodes);
+                    outOfMemory();
+                }
+                nodes = grown;
+            }
+            nodes[nodeCount++] = AS_ROPE(node)->right;
+            node = AS_ROPE(node)->left;
+            continue;
+        } else {
+            ObjString* string = IS_ROPE(node)
+                                    ? DEREF(ObjString, AS_ROPE(node)->flat)
+                                    : AS_STRING(node);
+            memcpy(chars + offset, string->chars, string->length);
+            offset += string->length;
+        }
+
+        if (nodeCount == 0) break;
+        node = nodes[--nodeCount];
+    }
+    free(nodes);
+    chars[offset] = '\0';
+
+    ObjString* flat = internString(result);
+    rope->flat = REF(flat);
+    rope->left = NIL_VAL;
+    rope->right = NIL_VAL;
+    return flat;
+}
+
 uint32_t hashString(const char* key, int length) {
     uint32_t hash = 2166136261u;
     for (int i = 0; i < length; i++) {
@@ -237,33 +438,82 @@ ObjString* makeString(int length) {
     ObjString* string =
         (ObjString*)allocateObject(sizeof(ObjString) + length + 1, OBJ_STRING);
     string->length = length;
+    string->hash = 0;
+    string->chars[length] = '\0';
     return string;
 }
 
-ObjString* takeString(const char* chars, int length, uint32_t hash) {
+static ObjString* addString(ObjString* string) {
+    push(OBJ_VAL(string));
+    tableSet(&vm.strings, string, NIL_VAL);
+    pop();
+    return string;
+}
+
+ObjString* internString(ObjString* string) {
+    string->hash = hashString(string->chars, string->length);
+    ObjString* interned = tableFindString(&vm.strings, string->chars,
+                                          string->length, string->hash);
+    if (interned == NULL) return addString(string);
+
+    // Nobody else has seen the duplicate yet.
+    reallocateObject(string, sizeof(ObjString) + string->length + 1, 0);
+    return interned;
+}
+
+ObjString* copyString(const char* chars, int length) {
+    uint32_t hash = hashString(chars, length);
     ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
     if (interned != NULL) return interned;
 
     ObjString* string = makeString(length);
-    push(OBJ_VAL(string));
     memcpy(string->chars, chars, length);
-    string->chars[length] = '\0';
     string->hash = hash;
-    tableSet(&vm.strings, string, NIL_VAL);
-    pop();
+    return addString(string);
+}
 
-    return string;
+Value copyStringValue(const char* chars, int length) {
+    if (FITS_SHORT_STRING(length)) {
+        return shortStringToValue(chars, length);
+    }
+    return OBJ_VAL(copyString(chars, length));
 }
 
-ObjString* copyString(const char* chars, int length) {
-    uint32_t hash = hashString(chars, length);
-    return takeString(chars, length, hash);
+// Returns the characters of a flat string value; short strings are decoded
+// into `buffer`.
+static const char* stringChars(Value value, char* buffer) {
+    if (IS_SHORT_STRING(value)) {
+        shortStringChars(value, buffer);
+        return buffer;
+    }
+    return AS_CSTRING(value);
+}
+
+Value concatenateStrings(Value a, Value b) {
+    int aLength = stringLength(a);
+    int bLength = stringLength(b);
+    int length = aLength + bLength;
+    char aBuffer[SHORT_STRING_MAX + 1];
+    char bBuffer[SHORT_STRING_MAX + 1];
+    const char* aChars = stringChars(a, aBuffer);
+    const char* bChars = stringChars(b, bBuffer);
+
+    if (FITS_SHORT_STRING(length)) {
+        char chars[SHORT_STRING_MAX + 1];
+        memcpy(chars, aChars, aLength);
+        memcpy(chars + aLength, bChars, bLength);
+        return shortStringToValue(chars, length);
+    }
+
+    ObjString* result = makeString(length);
+    memcpy(result->chars, aChars, aLength);
+    memcpy(result->chars + aLength, bChars, bLength);
+    return OBJ_VAL(internString(result));
 }
 
 ObjUpvalue* newUpvalue(Value* slot) {
     ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
     upvalue->location = slot;
-    upvalue->next = NULL;
     upvalue->closed = NIL_VAL;
     return upvalue;
 }
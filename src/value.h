@@ -1,9 +1,11 @@
 #ifndef clox_value_h
 #define clox_value_h
 
+#include <math.h>
 #include <string.h>
 
 #include "common.h"
+#include "heap.h"
 #include "lines.h"
 
 typedef enum { VAL_BOOL, VAL_NIL, VAL_NUMBER, VAL_OBJ } ValueType;
@@ -12,18 +14,36 @@ typedef enum {
     OBJ_BOUND_METHOD,
     OBJ_CLASS,
     OBJ_CLOSURE,
+    OBJ_FLOAT64_ARRAY,
     OBJ_FUNCTION,
     OBJ_INSTANCE,
+    OBJ_LIST,
+    OBJ_MAP,
     OBJ_NATIVE,
+    OBJ_ROPE,
     OBJ_STRING,
     OBJ_UPVALUE,
 } ObjType;
 
-typedef struct {
-    ObjType type;
+#ifdef COMPRESSED_REFS
+// Object fields hold 32 bit heap refs; go through REF()/DEREF() to use them.
+#define OBJ_REF(type) ObjRef
+#define REF(object) heapRef(object)
+#define DEREF(type, ref) ((type *)heapDeref(ref))
+#else
+#define OBJ_REF(type) type *
+#define REF(object) (object)
+#define DEREF(type, ref) ((type *)(ref))
+#endif
+
+// One word: objects are enumerated by walking the heap, not through a list.
+typedef struct Obj {
+    uint8_t type;  // ObjType, or HEAP_FREE_BLOCK.
     bool isMarked;
-    // forward struct declaration; pointer only.
-    struct Obj *next;
+    // Collections survived; room for a generational collector.
+    uint8_t age;
+    // Heap block size in HEAP_ALIGNMENT units, set by heapAllocate().
+    uint32_t units;
 } Obj;
 
 #ifdef NAN_BOXING
@@ -33,14 +53,33 @@ typedef struct {
 #define TAG_FALSE 2  // 10.
 #define TAG_TRUE 3   // 11.
 #define SIGN_BIT ((uint64_t)0x8000000000000000)
+// Bits 48-49 of a quiet NaN tell immediates apart; 00 are the singletons.
+#define TAG_MASK ((uint64_t)3 << 48)
+#define TAG_INT ((uint64_t)1 << 48)
+#define TAG_SHORT_STRING ((uint64_t)2 << 48)
+// Strings up to SHORT_STRING_MAX bytes are stored in the payload itself:
+// [3 bit length][5 bytes of chars, first char lowest]. They are never
+// allocated, interned or traced.
+#define SHORT_STRING_MAX 5
 typedef uint64_t Value;
 
 #define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value) ((value) == NIL_VAL)
-#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_DOUBLE(value) (((value) & QNAN) != QNAN)
+// Integral numbers in int32 range are tagged ints; to the language both are
+// just numbers, AS_NUMBER() widens ints to double.
+#define IS_INT(value) \
+    (((value) & (SIGN_BIT | QNAN | TAG_MASK)) == (QNAN | TAG_INT))
+#define IS_NUMBER(value) (IS_DOUBLE(value) || IS_INT(value))
 #define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_SHORT_STRING(value) \
+    (((value) & (SIGN_BIT | QNAN | TAG_MASK)) == (QNAN | TAG_SHORT_STRING))
+
+#define SHORT_STRING_LENGTH(value) ((int)(((value) >> 40) & 0x7))
+#define FITS_SHORT_STRING(length) ((length) <= SHORT_STRING_MAX)
 
 #define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_INT(value) ((int32_t)(uint32_t)(value))
 #define AS_NUMBER(value) valueToNum(value)
 #define AS_OBJ(value) ((Obj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
 
@@ -48,10 +87,13 @@ typedef uint64_t Value;
 #define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
 #define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define INT_VAL(i) ((Value)(QNAN | TAG_INT | (uint64_t)(uint32_t)(i)))
 #define NUMBER_VAL(num) numToValue(num)
+#define INT_OR_NUMBER_VAL(num) intOrNumToValue(num)
 #define OBJ_VAL(obj) (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
 static inline double valueToNum(Value value) {
+    if (IS_INT(value)) return (double)AS_INT(value);
     double num;
     memcpy(&num, &value, sizeof(Value));
     return num;
@@ -63,6 +105,34 @@ static inline Value numToValue(double num) {
     return value;
 }
 
+// Tags `num` as an int when that is lossless; -0 has to stay a double.
+static inline Value intOrNumToValue(double num) {
+    if (num >= INT32_MIN && num <= INT32_MAX && num == (int32_t)num &&
+        (num != 0 || !signbit(num))) {
+        return INT_VAL((int32_t)num);
+    }
+    return numToValue(num);
+}
+
+static inline Value shortStringToValue(const char *chars, int length) {
+    uint64_t bits = (uint64_t)length << 40;
+    for (int i = 0; i < length; i++) {
+        bits |= (uint64_t)(uint8_t)chars[i] << (8 * i);
+    }
+    return (Value)(QNAN | TAG_SHORT_STRING | bits);
+}
+
+// Decodes into `chars`, which must hold SHORT_STRING_MAX + 1 bytes.
+static inline void shortStringChars(Value value, char *chars) {
+    int length = SHORT_STRING_LENGTH(value);
+    // Never true; keeps GCC from assuming 7 chars from the 3 bit field.
+    if (length > SHORT_STRING_MAX) length = SHORT_STRING_MAX;
+    for (int i = 0; i < length; i++) {
+        chars[i] = (char)((value >> (8 * i)) & 0xff);
+    }
+    chars[length] = '\0';
+}
+
 #else
 typedef struct {
     ValueType type;
@@ -84,25 +154,48 @@ typedef struct {
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+
+// Tagged ints need the NaN-boxed payload; every number is a double.
+#define IS_INT(value) false
+#define AS_INT(value) 0
+#define INT_VAL(i) NUMBER_VAL((double)(i))
+#define INT_OR_NUMBER_VAL(num) NUMBER_VAL(num)
 #define OBJ_VAL(value) ((Value){VAL_OBJ, {.obj = (Obj *)value}})
 
+// Immediate strings need the NaN-boxed payload; every string is an ObjString.
+#define SHORT_STRING_MAX 0
+#define IS_SHORT_STRING(value) false
+#define SHORT_STRING_LENGTH(value) 0
+#define FITS_SHORT_STRING(length) false
+#define shortStringToValue(chars, length) NIL_VAL
+#define shortStringChars(value, chars) ((chars)[0] = '\0')
+
 #endif
 
-#define OBJ_TYPE(value) (AS_OBJ(value)->type)
+#define OBJ_TYPE(value) ((ObjType)AS_OBJ(value)->type)
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
 #define IS_CLASS(value) isObjType(value, OBJ_CLASS)
 #define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
+#define IS_FLOAT64_ARRAY(value) isObjType(value, OBJ_FLOAT64_ARRAY)
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value) isObjType(value, OBJ_INSTANCE)
+#define IS_LIST(value) isObjType(value, OBJ_LIST)
+#define IS_MAP(value) isObjType(value, OBJ_MAP)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
-#define IS_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
+#define IS_STRING(value) \
+    (IS_SHORT_STRING(value) || isObjType(value, OBJ_STRING))
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
 #define AS_CLASS(value) ((ObjClass *)AS_OBJ(value))
 #define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
+#define AS_FLOAT64_ARRAY(value) ((ObjFloat64Array *)AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
 #define AS_INSTANCE(value) ((ObjInstance *)AS_OBJ(value))
-#define AS_NATIVE(value) (((ObjNative *)AS_OBJ(value))->function)
+#define AS_LIST(value) ((ObjList *)AS_OBJ(value))
+#define AS_MAP(value) ((ObjMap *)AS_OBJ(value))
+#define AS_NATIVE(value) ((ObjNative *)AS_OBJ(value))
+#define AS_ROPE(value) ((ObjRope *)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
 
@@ -123,14 +216,37 @@ typedef struct {
     char chars[];
 } ObjString;
 
+// Lazy concatenation of two string values (short, ObjString or ObjRope). The
+// characters are only copied out once, by flattenRope(), when needed.
+typedef struct {
+    Obj obj;
+    int length;
+    Value left;
+    Value right;
+    // interned result; left/right are dropped once flattened.
+    OBJ_REF(ObjString) flat;
+} ObjRope;
+
 typedef struct {
     Obj obj;
     Value *location;
     Value closed;
-    // forward struct declaration; pointer only.
-    struct ObjUpvalue *next;
 } ObjUpvalue;
 
+// A call the optimizer inlined: the callee, the line in it the code came
+// from, and the inlined call around this one, or -1.
+typedef struct {
+    OBJ_REF(ObjString) name;
+    int line;
+    int parent;
+} InlineFrame;
+
+// Code from `start` on belongs to inline frame `frame`, or -1 for none.
+typedef struct {
+    int start;
+    int frame;
+} InlineRun;
+
 typedef struct {
     Obj obj;
     int arity;
@@ -141,53 +257,125 @@ typedef struct {
         uint8_t *code;
         Lines lines;
         ValueArray constants;
+        // Kept so stack traces still show the calls that were inlined.
+        InlineFrame *inlineFrames;
+        int inlineFrameCount;
+        InlineRun *inlineRuns;
+        int inlineRunCount;
+        // Code and lines live in a mapped bytecode image, read only, and
+        // are not ours to free.
+        bool mapped;
     } chunk;
-    ObjString *name;
+    OBJ_REF(ObjString) name;
     int upvalueCount;
+    // Compiled as a frame closure: reads captures from its caller's frame.
+    bool readsEnclosingFrame;
 } ObjFunction;
 
 typedef struct {
     Obj obj;
-    ObjFunction *function;
-    ObjUpvalue **upvalues;
+    OBJ_REF(ObjFunction) function;
     int upvalueCount;
+    OBJ_REF(ObjUpvalue) upvalues[];
 } ObjClosure;
 
-typedef Value (*NativeFn)(int argCount, Value *args);
+static inline size_t closureSize(int upvalueCount) {
+    return sizeof(ObjClosure) + sizeof(OBJ_REF(ObjUpvalue)) * upvalueCount;
+}
+
+struct VM;
+
+// A native reads its arguments in place on the VM stack and stores its return
+// value through result. It returns false after raising a runtimeError().
+typedef bool (*NativeFn)(struct VM *vm, int argCount, Value *args,
+                         Value *result);
+
+// ObjNative::arity of a native that takes any number of arguments.
+#define NATIVE_VARIADIC -1
 
 typedef struct {
     Obj obj;
     NativeFn function;
+    // Checked by the VM, so natives can index args without looking.
+    int arity;
+    // OpCode the compiler emits in place of a direct call, or -1.
+    int intrinsic;
 } ObjNative;
 
 typedef struct {
     Obj obj;
-    ObjString *name;
+    OBJ_REF(ObjString) name;
     // forward struct declaration; On stack; sync or [X_X] segfault.
-    struct Table1 {
+    struct Table {
         int count;
         int capacity;
-        void *entries;
+        struct Entry *entries;
     } methods;
 } ObjClass;
 
 typedef struct {
     Obj obj;
-    ObjClass *klass;
+    OBJ_REF(ObjClass) klass;
     // forward struct declaration; On stack; sync or [X_X] segfault.
-    struct Table2 {
-        int count;
-        int capacity;
-        void *entries;
-    } fields;
+    struct Table fields;
 } ObjInstance;
 
 typedef struct {
     Obj obj;
     Value receiver;
-    ObjClosure *method;
+    OBJ_REF(ObjClosure) method;
 } ObjBoundMethod;
 
+typedef struct {
+    Obj obj;
+    ValueArray items;
+} ObjList;
+
+// Raw doubles for the bulk numeric natives; fixed length.
+typedef struct {
+    Obj obj;
+    int length;
+    double values[];
+} ObjFloat64Array;
+
+static inline size_t float64ArraySize(int length) {
+    return sizeof(ObjFloat64Array) + sizeof(double) * length;
+}
+
+typedef struct {
+    Obj obj;
+    // forward struct declaration; On stack; sync or [X_X] segfault.
+    struct ValueTable {
+        // Entries in use, tombstones included.
+        int count;
+        int capacity;
+        struct ValueEntry *entries;
+        // Keys in the map, the nil key included.
+        int size;
+        // nil marks empty entries, so the nil key is kept out of line.
+        bool hasNilKey;
+        Value nilValue;
+    } table;
+} ObjMap;
+
+static inline int stringLength(Value value) {
+    if (IS_SHORT_STRING(value)) return SHORT_STRING_LENGTH(value);
+    if (IS_ROPE(value)) return AS_ROPE(value)->length;
+    return AS_STRING(value)->length;
+}
+
+static inline bool isFalsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Results of int arithmetic promote to double once they leave int32 range.
+static inline Value intResult(int64_t value) {
+    if (value >= INT32_MIN && value <= INT32_MAX) {
+        return INT_VAL((int32_t)value);
+    }
+    return NUMBER_VAL((double)value);
+}
+
 bool valuesEqual(Value a, Value b);
 void initValueArray(ValueArray *valueArray);
 void freeValueArray(ValueArray *valueArray);
@@ -198,12 +386,22 @@ void printValue(Value value);
 ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method);
 ObjClass *newClass(ObjString *name);
 ObjClosure *newClosure(ObjFunction *function);
+ObjFloat64Array *newFloat64Array(int length);
 ObjFunction *newFunction();
 ObjInstance *newInstance(ObjClass *klass);
-ObjNative *newNative(NativeFn function);
+ObjList *newList();
+ObjMap *newMap();
+ObjNative *newNative(NativeFn function, int arity);
+ObjRope *newRope(Value left, Value right, int length);
+ObjString *flattenRope(ObjRope *rope);
+// Allocates an uninterned string of `length` chars for the caller to fill in;
+// it must be passed to internString() before anything else is allocated.
 ObjString *makeString(int length);
-ObjString *takeString(const char *chars, int length, uint32_t hash);
+ObjString *internString(ObjString *string);
 ObjString *copyString(const char *chars, int length);
+Value copyStringValue(const char *chars, int length);
+// Joins two flat strings, which the caller keeps reachable.
+Value concatenateStrings(Value a, Value b);
 ObjUpvalue *newUpvalue(Value *slot);
 uint32_t hashString(const char *key, int length);
 void printObject(Value value);
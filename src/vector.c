@@ -0,0 +1,296 @@
+#include "vector.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define VECTOR_X86
+#endif
+
+VectorKernels vectorKernels;
+
+static void addScalar(double *out, const double *a, const double *b,
+                      int count) {
+    for (int i = 0; i < count; i++) out[i] = a[i] + b[i];
+}
+
+static void mulScalar(double *out, const double *a, const double *b,
+                      int count) {
+    for (int i = 0; i < count; i++) out[i] = a[i] * b[i];
+}
+
+static void scaleScalar(double *out, const double *a, double factor,
+                        int count) {
+    for (int i = 0; i < count; i++) out[i] = a[i] * factor;
+}
+
+static void axpyScalar(double alpha, const double *x, double *y, int count) {
+    for (int i = 0; i < count; i++) y[i] += alpha * x[i];
+}
+
+static double dotScalar(const double *a, const double *b, int count) {
+    double sum = 0;
+    for (int i = 0; i < count; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+static double sumScalar(const double *a, int count) {
+    double sum = 0;
+    for (int i = 0; i < count; i++) sum += a[i];
+    return sum;
+}
+
+static double minScalar(const double *a, int count) {
+    double min = a[0];
+    for (int i = 1; i < count; i++) {
+        if (a[i] < min) min = a[i];
+    }
+    return min;
+}
+
+static double maxScalar(const double *a, int count) {
+    double max = a[0];
+    for (int i = 1; i < count; i++) {
+        if (a[i] > max) max = a[i];
+    }
+    return max;
+}
+
+#ifdef VECTOR_X86
+
+// SSE2 is part of x86-64, so these need no check. Loads and stores are
+// unaligned: array payloads are only 8 byte aligned.
+
+static void addSse2(double *out, const double *a, const double *b,
+                    int count) {
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        _mm_storeu_pd(out + i,
+                      _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    }
+    addScalar(out + i, a + i, b + i, count - i);
+}
+
+static void mulSse2(double *out, const double *a, const double *b,
+                    int count) {
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        _mm_storeu_pd(out + i,
+                      _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    }
+    mulScalar(out + i, a + i, b + i, count - i);
+}
+
+static void scaleSse2(double *out, const double *a, double factor,
+                      int count) {
+    __m128d f = _mm_set1_pd(factor);
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        _mm_storeu_pd(out + i, _mm_mul_pd(_mm_loadu_pd(a + i), f));
+    }
+    scaleScalar(out + i, a + i, factor, count - i);
+}
+
+static void axpySse2(double alpha, const double *x, double *y, int count) {
+    __m128d a = _mm_set1_pd(alpha);
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128d product = _mm_mul_pd(a, _mm_loadu_pd(x + i));
+        _mm_storeu_pd(y + i, _mm_add_pd(_mm_loadu_pd(y + i), product));
+    }
+    axpyScalar(alpha, x + i, y + i, count - i);
+}
+
+static double horizontalSse2(__m128d v) {
+    return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+static double dotSse2(const double *a, const double *b, int count) {
+    __m128d sum0 = _mm_setzero_pd();
+    __m128d sum1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        sum0 = _mm_add_pd(
+            sum0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        sum1 = _mm_add_pd(sum1, _mm_mul_pd(_mm_loadu_pd(a + i + 2),
+                                           _mm_loadu_pd(b + i + 2)));
+    }
+    return horizontalSse2(_mm_add_pd(sum0, sum1)) +
+           dotScalar(a + i, b + i, count - i);
+}
+
+static double sumSse2(const double *a, int count) {
+    __m128d sum0 = _mm_setzero_pd();
+    __m128d sum1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        sum0 = _mm_add_pd(sum0, _mm_loadu_pd(a + i));
+        sum1 = _mm_add_pd(sum1, _mm_loadu_pd(a + i + 2));
+    }
+    return horizontalSse2(_mm_add_pd(sum0, sum1)) +
+           sumScalar(a + i, count - i);
+}
+
+static double minSse2(const double *a, int count) {
+    if (count < 2) return minScalar(a, count);
+    __m128d min = _mm_loadu_pd(a);
+    int i = 2;
+    for (; i + 2 <= count; i += 2) min = _mm_min_pd(min, _mm_loadu_pd(a + i));
+    double lanes[2];
+    _mm_storeu_pd(lanes, min);
+    double result = lanes[0] < lanes[1] ? lanes[0] : lanes[1];
+    if (i < count) {
+        double rest = minScalar(a + i, count - i);
+        if (rest < result) result = rest;
+    }
+    return result;
+}
+
+static double maxSse2(const double *a, int count) {
+    if (count < 2) return maxScalar(a, count);
+    __m128d max = _mm_loadu_pd(a);
+    int i = 2;
+    for (; i + 2 <= count; i += 2) max = _mm_max_pd(max, _mm_loadu_pd(a + i));
+    double lanes[2];
+    _mm_storeu_pd(lanes, max);
+    double result = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+    if (i < count) {
+        double rest = maxScalar(a + i, count - i);
+        if (rest > result) result = rest;
+    }
+    return result;
+}
+
+// Compiled for AVX2 regardless of the build flags and only called once
+// initVectorKernels() has seen the CPU support it.
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static void addAvx2(double *out, const double *a, const double *b,
+                         int count) {
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(a + i),
+                                                _mm256_loadu_pd(b + i)));
+    }
+    addScalar(out + i, a + i, b + i, count - i);
+}
+
+AVX2 static void mulAvx2(double *out, const double *a, const double *b,
+                         int count) {
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i),
+                                                _mm256_loadu_pd(b + i)));
+    }
+    mulScalar(out + i, a + i, b + i, count - i);
+}
+
+AVX2 static void scaleAvx2(double *out, const double *a, double factor,
+                           int count) {
+    __m256d f = _mm256_set1_pd(factor);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), f));
+    }
+    scaleScalar(out + i, a + i, factor, count - i);
+}
+
+AVX2 static void axpyAvx2(double alpha, const double *x, double *y,
+                          int count) {
+    __m256d a = _mm256_set1_pd(alpha);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d product = _mm256_mul_pd(a, _mm256_loadu_pd(x + i));
+        _mm256_storeu_pd(y + i,
+                         _mm256_add_pd(_mm256_loadu_pd(y + i), product));
+    }
+    axpyScalar(alpha, x + i, y + i, count - i);
+}
+
+AVX2 static double horizontalAvx2(__m256d v) {
+    __m128d half = _mm_add_pd(_mm256_castpd256_pd128(v),
+                              _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+}
+
+AVX2 static double dotAvx2(const double *a, const double *b, int count) {
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        sum0 = _mm256_add_pd(sum0, _mm256_mul_pd(_mm256_loadu_pd(a + i),
+                                                 _mm256_loadu_pd(b + i)));
+        sum1 = _mm256_add_pd(sum1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4),
+                                                 _mm256_loadu_pd(b + i + 4)));
+    }
+    return horizontalAvx2(_mm256_add_pd(sum0, sum1)) +
+           dotScalar(a + i, b + i, count - i);
+}
+
+AVX2 static double sumAvx2(const double *a, int count) {
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        sum0 = _mm256_add_pd(sum0, _mm256_loadu_pd(a + i));
+        sum1 = _mm256_add_pd(sum1, _mm256_loadu_pd(a + i + 4));
+    }
+    return horizontalAvx2(_mm256_add_pd(sum0, sum1)) +
+           sumScalar(a + i, count - i);
+}
+
+AVX2 static double minAvx2(const double *a, int count) {
+    if (count < 4) return minScalar(a, count);
+    __m256d min = _mm256_loadu_pd(a);
+    int i = 4;
+    for (; i + 4 <= count; i += 4) {
+        min = _mm256_min_pd(min, _mm256_loadu_pd(a + i));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, min);
+    double result = minScalar(lanes, 4);
+    if (i < count) {
+        double rest = minScalar(a + i, count - i);
+        if (rest < result) result = rest;
+    }
+    return result;
+}
+
+AVX2 static double maxAvx2(const double *a, int count) {
+    if (count < 4) return maxScalar(a, count);
+    __m256d max = _mm256_loadu_pd(a);
+    int i = 4;
+    for (; i + 4 <= count; i += 4) {
+        max = _mm256_max_pd(max, _mm256_loadu_pd(a + i));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, max);
+    double result = maxScalar(lanes, 4);
+    if (i < count) {
+        double rest = maxScalar(a + i, count - i);
+        if (rest > result) result = rest;
+    }
+    return result;
+}
+
+#endif
+
+void initVectorKernels() {
+#ifdef VECTOR_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        vectorKernels = (VectorKernels){
+            "avx2",  addAvx2, mulAvx2, scaleAvx2, axpyAvx2,
+            dotAvx2, sumAvx2, minAvx2, maxAvx2,
+        };
+        return;
+    }
+    vectorKernels = (VectorKernels){
+        "sse2",  addSse2, mulSse2, scaleSse2, axpySse2,
+        dotSse2, sumSse2, minSse2, maxSse2,
+    };
+#else
+    vectorKernels = (VectorKernels){
+        "scalar",  addScalar, mulScalar, scaleScalar, axpyScalar,
+        dotScalar, sumScalar, minScalar, maxScalar,
+    };
+#endif
+}
@@ -0,0 +1,28 @@
+#ifndef clox_vector_h
+#define clox_vector_h
+
+#include "common.h"
+
+// Bulk kernels over raw doubles. initVectorKernels() picks the widest set the
+// CPU supports: AVX2, SSE2 or plain C. Summing kernels split the work over
+// several accumulators, so results can differ from a left to right loop in
+// the last bits.
+typedef struct {
+    const char *name;
+    void (*add)(double *out, const double *a, const double *b, int count);
+    void (*mul)(double *out, const double *a, const double *b, int count);
+    void (*scale)(double *out, const double *a, double factor, int count);
+    // y += alpha * x.
+    void (*axpy)(double alpha, const double *x, double *y, int count);
+    double (*dot)(const double *a, const double *b, int count);
+    double (*sum)(const double *a, int count);
+    // count must be positive.
+    double (*min)(const double *a, int count);
+    double (*max)(const double *a, int count);
+} VectorKernels;
+
+extern VectorKernels vectorKernels;
+
+void initVectorKernels();
+
+#endif
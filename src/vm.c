@@ -2,38 +2,46 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <time.h>
 
 #include "chunk.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
 #include "memory.h"
+#include "natives.h"
 
 VM vm;
 
-static Value clockNative(int argCount, Value *args) {
-    return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
-}
+// Frames shown at either end of a runtime error's stack trace.
+#define TRACE_FRAMES 32
 
 static void resetStack() {
     vm.stackTop = vm.stack;
     vm.frameCount = 0;
-    vm.openUpvalues = NULL;
-}
-
-static void defineNative(const char *name, NativeFn function) {
-    push(OBJ_VAL(copyString(name, (int)strlen(name))));
-    push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-    pop();
-    pop();
+    for (int i = 0; i < vm.openUpvalueTop; i++) {
+        vm.openUpvalues[i] = NULL;
+    }
+    vm.openUpvalueTop = 0;
 }
 
 void initVM() {
+    initHeap();
+    vm.frames = (CallFrame *)malloc(sizeof(CallFrame) * FRAMES_INITIAL);
+    vm.frameCapacity = FRAMES_INITIAL;
+    vm.maxFrames = FRAMES_MAX;
+    vm.stack = (Value *)malloc(sizeof(Value) * STACK_INITIAL);
+    vm.stackLimit = vm.stack + STACK_INITIAL;
+    vm.openUpvalues =
+        (ObjUpvalue **)calloc(STACK_INITIAL, sizeof(ObjUpvalue *));
+    vm.openUpvalueTop = 0;
+    if (vm.frames == NULL || vm.stack == NULL || vm.openUpvalues == NULL) {
+        fprintf(stderr, "vm: not enough memory for the stack\n");
+        exit(1);
+    }
     resetStack();
-    vm.objects = NULL;
+    vm.errorJump = NULL;
     vm.bytesAllocated = 0;
     vm.nextGC = 1024 * 1024;
     vm.grayCount = 0;
@@ -46,7 +54,7 @@ void initVM() {
     vm.initString = NULL;
     vm.initString = copyString("init", 4);
 
-    defineNative("clock", clockNative);
+    defineNatives();
 }
 
 void freeVM() {
@@ -54,9 +62,13 @@ void freeVM() {
     freeTable(&vm.strings);
     vm.initString = NULL;
     freeObjects();
+    freeHeap();
+    free(vm.frames);
+    free(vm.stack);
+    free(vm.openUpvalues);
 }
 
-static void runtimeError(const char *format, ...) {
+void runtimeError(const char *format, ...) {
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
@@ -64,22 +76,76 @@ static void runtimeError(const char *format, ...) {
     fputs("\n", stderr);
 
     for (int i = vm.frameCount - 1; i >= 0; i--) {
+        // Deep recursion: keep the innermost and outermost frames.
+        if (i == vm.frameCount - 1 - TRACE_FRAMES && i >= TRACE_FRAMES) {
+            fprintf(stderr, "[... %d more frames]\n", i + 1 - TRACE_FRAMES);
+            i = TRACE_FRAMES - 1;
+        }
+
         CallFrame *frame = &vm.frames[i];
-        ObjFunction *function = frame->closure->function;
+        ObjFunction *function = DEREF(ObjFunction, frame->closure->function);
         Chunk *chunk = (Chunk *)&function->chunk;
         size_t instruction = frame->ip - chunk->code - 1;
+        for (int inlined = getInlineFrame(chunk, instruction); inlined != -1;
+             inlined = chunk->inlineFrames[inlined].parent) {
+            InlineFrame *callee = &chunk->inlineFrames[inlined];
+            fprintf(stderr, "[line %d] in %s()\n", callee->line,
+                    DEREF(ObjString, callee->name)->chars);
+        }
         fprintf(stderr, "[line %d] in ", getLine(chunk, instruction));
-        if (function->name == NULL) {
+        ObjString *name = DEREF(ObjString, function->name);
+        if (name == NULL) {
             fprintf(stderr, "script\n");
         } else {
-            fprintf(stderr, "%s()\n", function->name->chars);
+            fprintf(stderr, "%s()\n", name->chars);
         }
     }
 
     resetStack();
 }
 
+void outOfMemory() {
+    if (vm.errorJump == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    runtimeError("Out of memory.");
+    longjmp(*vm.errorJump, 1);
+}
+
+// Moves the value stack to a bigger block and fixes up every pointer into it:
+// stackTop, frame slots and open upvalues.
+static void growStack() {
+    int capacity = (int)(vm.stackLimit - vm.stack);
+    int newCapacity = GROW_CAPACITY(capacity);
+    Value *stack = (Value *)malloc(sizeof(Value) * newCapacity);
+    ObjUpvalue **openUpvalues =
+        (ObjUpvalue **)calloc(newCapacity, sizeof(ObjUpvalue *));
+    if (stack == NULL || openUpvalues == NULL) {
+        free(stack);
+        free(openUpvalues);
+        outOfMemory();
+    }
+    memcpy(stack, vm.stack, sizeof(Value) * capacity);
+    memcpy(openUpvalues, vm.openUpvalues, sizeof(ObjUpvalue *) * capacity);
+
+    vm.stackTop = stack + (vm.stackTop - vm.stack);
+    for (int i = 0; i < vm.frameCount; i++) {
+        vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+    }
+    for (int i = 0; i < vm.openUpvalueTop; i++) {
+        if (openUpvalues[i] != NULL) openUpvalues[i]->location = stack + i;
+    }
+
+    free(vm.stack);
+    free(vm.openUpvalues);
+    vm.stack = stack;
+    vm.stackLimit = stack + newCapacity;
+    vm.openUpvalues = openUpvalues;
+}
+
 void push(Value value) {
+    if (vm.stackTop == vm.stackLimit) growStack();
     *vm.stackTop = value;
     vm.stackTop++;
 }
@@ -92,31 +158,58 @@ Value pop() {
 static Value peek(int distance) { return vm.stackTop[-1 - distance]; }
 
 static bool call(ObjClosure *closure, int argCount) {
-    if (argCount != closure->function->arity) {
-        runtimeError("Expected %d arguments but got %d.",
-                     closure->function->arity, argCount);
+    ObjFunction *function = DEREF(ObjFunction, closure->function);
+    if (argCount != function->arity) {
+        runtimeError("Expected %d arguments but got %d.", function->arity,
+                     argCount);
         return false;
     }
 
-    if (vm.frameCount == FRAMES_MAX) {
+    if (vm.frameCount == vm.maxFrames) {
         runtimeError("Stack overflow.");
         return false;
     }
 
+    if (vm.frameCount == vm.frameCapacity) {
+        int capacity = GROW_CAPACITY(vm.frameCapacity);
+        if (capacity > vm.maxFrames) capacity = vm.maxFrames;
+        CallFrame *frames =
+            (CallFrame *)realloc(vm.frames, sizeof(CallFrame) * capacity);
+        if (frames == NULL) outOfMemory();
+        vm.frames = frames;
+        vm.frameCapacity = capacity;
+    }
+
     CallFrame *frame = &vm.frames[vm.frameCount++];
     frame->closure = closure;
-    frame->ip = ((Chunk *)(&closure->function->chunk))->code;
+    frame->ip = ((Chunk *)(&function->chunk))->code;
     frame->slots = vm.stackTop - argCount - 1;
     return true;
 }
 
+// The arguments stay where they are and the result lands in the callee's
+// slot, so the call needs no pushing or popping beyond dropping the args.
+// The slot is found again by index: a native that calls back into Lox may
+// have moved the stack.
+static bool callNative(ObjNative *native, int argCount) {
+    if (vm.stackTop + NATIVE_STACK_SLOTS > vm.stackLimit) growStack();
+
+    Value *args = vm.stackTop - argCount;
+    ptrdiff_t callee = args - 1 - vm.stack;
+    Value result;
+    if (!native->function(&vm, argCount, args, &result)) return false;
+    vm.stack[callee] = result;
+    vm.stackTop = vm.stack + callee + 1;
+    return true;
+}
+
 static bool callValue(Value callee, int argCount) {
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee)) {
             case OBJ_BOUND_METHOD: {
                 ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
                 vm.stackTop[-argCount - 1] = bound->receiver;
-                return call(bound->method, argCount);
+                return call(DEREF(ObjClosure, bound->method), argCount);
             }
 
             case OBJ_CLASS: {
@@ -140,11 +233,14 @@ static bool callValue(Value callee, int argCount) {
             }
 
             case OBJ_NATIVE: {
-                NativeFn native = AS_NATIVE(callee);
-                Value result = native(argCount, vm.stackTop - argCount);
-                vm.stackTop -= argCount + 1;
-                push(result);
-                return true;
+                ObjNative *native = AS_NATIVE(callee);
+                if (native->arity != NATIVE_VARIADIC &&
+                    argCount != native->arity) {
+                    runtimeError("Expected %d arguments but got %d.",
+                                 native->arity, argCount);
+                    return false;
+                }
+                return callNative(native, argCount);
             }
 
             default:
@@ -178,7 +274,7 @@ static bool invoke(ObjString *name, int argCount) {
         vm.stackTop[-argCount - 1] = value;
         return callValue(value, argCount);
     }
-    return invokeFromClass(instance->klass, name, argCount);
+    return invokeFromClass(DEREF(ObjClass, instance->klass), name, argCount);
 }
 
 static bool bindMethod(ObjClass *klass, ObjString *name) {
@@ -195,35 +291,49 @@ static bool bindMethod(ObjClass *klass, ObjString *name) {
 }
 
 static ObjUpvalue *captureUpvalue(Value *local) {
-    ObjUpvalue *prevUpvalue = NULL;
-    ObjUpvalue *upvalue = vm.openUpvalues;
-    while (upvalue != NULL && upvalue->location > local) {
-        prevUpvalue = upvalue;
-        upvalue = (ObjUpvalue *)upvalue->next;
-    }
-
-    if (upvalue != NULL && upvalue->location == local) {
-        return upvalue;
-    }
+    int slot = (int)(local - vm.stack);
+    if (vm.openUpvalues[slot] != NULL) return vm.openUpvalues[slot];
 
     ObjUpvalue *createdUpvalue = newUpvalue(local);
-    createdUpvalue->next = (void *)upvalue;
-    if (prevUpvalue == NULL) {
-        vm.openUpvalues = createdUpvalue;
-    } else {
-        prevUpvalue->next = (void *)createdUpvalue;
-    }
-
+    vm.openUpvalues[slot] = createdUpvalue;
+    if (vm.openUpvalueTop <= slot) vm.openUpvalueTop = slot + 1;
     return createdUpvalue;
 }
 
+// Only the slots between `last` and the highest capture are visited, so a
+// return costs nothing when its frame captured nothing.
 static void closeUpvalues(Value *last) {
-    while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-        ObjUpvalue *upvalue = vm.openUpvalues;
+    int first = (int)(last - vm.stack);
+    while (vm.openUpvalueTop > first) {
+        int slot = --vm.openUpvalueTop;
+        ObjUpvalue *upvalue = vm.openUpvalues[slot];
+        if (upvalue == NULL) continue;
+
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
-        vm.openUpvalues = (ObjUpvalue *)upvalue->next;
+        vm.openUpvalues[slot] = NULL;
+    }
+}
+
+// `return f(...)`: the callee takes over the current frame and its slots.
+static bool tailCall(Value callee, int argCount) {
+    if (!IS_CLOSURE(callee)) return callValue(callee, argCount);
+
+    ObjClosure *closure = AS_CLOSURE(callee);
+    ObjFunction *function = DEREF(ObjFunction, closure->function);
+    // A frame closure reads its caller's frame, which has to stay put.
+    if (function->readsEnclosingFrame || argCount != function->arity) {
+        return call(closure, argCount);
     }
+
+    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    closeUpvalues(frame->slots);
+    memmove(frame->slots, vm.stackTop - argCount - 1,
+            sizeof(Value) * (argCount + 1));
+    vm.stackTop = frame->slots + argCount + 1;
+    frame->closure = closure;
+    frame->ip = ((Chunk *)&function->chunk)->code;
+    return true;
 }
 
 static void defineMethod(ObjString *name) {
@@ -233,42 +343,92 @@ static void defineMethod(ObjString *name) {
     pop();
 }
 
-static bool isFalsey(Value value) {
-    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+static bool isStringLike(Value value) {
+    return IS_STRING(value) || IS_ROPE(value);
+}
+
+// Replaces a rope on the stack with its flattened string.
+static void flattenAt(int distance) {
+    if (IS_ROPE(peek(distance))) {
+        // Flattening may grow the stack, so index it afterwards.
+        ObjString *flat = flattenRope(AS_ROPE(peek(distance)));
+        vm.stackTop[-1 - distance] = OBJ_VAL(flat);
+    }
+}
+
+bool mapKeyAt(int distance) {
+    Value key = peek(distance);
+    if (IS_INT(key)) return true;
+
+    if (IS_NUMBER(key)) {
+        double number = AS_NUMBER(key);
+        if (number == 0) number = 0;  // -0 is the same key.
+        vm.stackTop[-1 - distance] = INT_OR_NUMBER_VAL(number);
+    } else if (IS_ROPE(key)) {
+        flattenAt(distance);
+    } else if (!IS_STRING(key) && !IS_BOOL(key) && !IS_NIL(key)) {
+        runtimeError("Map key must be a number, string, boolean or nil.");
+        return false;
+    }
+    return true;
 }
 
 static void contatenate() {
-    ObjString *b = AS_STRING(peek(0));
-    ObjString *a = AS_STRING(peek(1));
-
-    int length = a->length + b->length;
-    char *chars = ALLOCATE(char, length);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    uint32_t hash = hashString(chars, length);
+    int length = stringLength(peek(1)) + stringLength(peek(0));
+    if (length >= ROPE_MIN_LENGTH) {
+        ObjRope *rope = newRope(peek(1), peek(0), length);
+        pop();
+        pop();
+        push(OBJ_VAL(rope));
+        return;
+    }
+
+    // Ropes are never shorter than ROPE_MIN_LENGTH, so both sides are flat.
+    Value result = concatenateStrings(peek(1), peek(0));
     pop();
     pop();
+    push(result);
+}
 
-    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
-    if (interned != NULL) {
-        FREE_ARRAY(char, chars, length);
-        push(OBJ_VAL(interned));
-        return;
+// Checks a subscript against the bounds of a list or array.
+static bool checkIndex(int length, Value index, int *slot) {
+    if (IS_INT(index) && (uint32_t)AS_INT(index) < (uint32_t)length) {
+        *slot = AS_INT(index);
+        return true;
     }
 
-    ObjString *result = takeString(chars, length, hash);
-    tableSet(&vm.strings, result, NIL_VAL);
-    push(OBJ_VAL(result));
+    if (!IS_NUMBER(index)) {
+        runtimeError("Index must be a number.");
+        return false;
+    }
+    double number = AS_NUMBER(index);
+    if (!(number >= 0 && number < length)) {
+        runtimeError("Index out of range.");
+        return false;
+    }
+    if (number != (int)number) {
+        runtimeError("Index must be an integer.");
+        return false;
+    }
+    *slot = (int)number;
+    return true;
 }
 
-static InterpretResult run() {
+// Runs until the frame above baseFrame returns.
+static InterpretResult run(int baseFrame) {
     CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    // Upper bits of the next constant operand, set by OP_WIDE.
+    int constantHigh = 0;
+    int constant;
 
 #define READ_BYTE() (*frame->ip++)
 #define READ_SHORT() \
     (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT() \
-    (((Chunk *)&frame->closure->function->chunk)->constants.values[READ_BYTE()])
+#define FRAME_CHUNK() \
+    ((Chunk *)&DEREF(ObjFunction, frame->closure->function)->chunk)
+#define READ_CONSTANT()                                   \
+    (constant = constantHigh | READ_BYTE(), constantHigh = 0, \
+     FRAME_CHUNK()->constants.values[constant])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
 #define BINARY_OP(valueType, op)                          \
     do {                                                  \
@@ -280,6 +440,18 @@ static InterpretResult run() {
         double a = AS_NUMBER(pop());                      \
         push(valueType(a op b));                          \
     } while (false)
+// Both operands tagged ints: do it in 64 bits, which can't overflow for
+// int32 inputs, and let intValueType decide on the result representation.
+#define INT_BINARY_OP(intValueType, valueType, op) \
+    do {                                           \
+        if (IS_INT(peek(0)) && IS_INT(peek(1))) {  \
+            int64_t b = AS_INT(pop());             \
+            int64_t a = AS_INT(pop());             \
+            push(intValueType(a op b));            \
+            break;                                 \
+        }                                          \
+        BINARY_OP(valueType, op);                  \
+    } while (false)
 #ifdef DEBUG_TRACE_EXECUTION
     printf("\n== trace execution ==");
 #endif
@@ -292,18 +464,18 @@ static InterpretResult run() {
             printf(" ]");
         }
         printf("\n");
-        disassembleInstruction(
-            (Chunk *)&frame->closure->function->chunk,
-            (int)(frame->ip -
-                  ((Chunk *)&frame->closure->function->chunk)->code));
+        disassembleInstruction(FRAME_CHUNK(),
+                               (int)(frame->ip - FRAME_CHUNK()->code));
 #endif
         uint8_t instruction;
         switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(constant);
+            case OP_CONSTANT:
+                push(READ_CONSTANT());
+                break;
+
+            case OP_WIDE:
+                constantHigh = READ_SHORT() << 8;
                 break;
-            }
 
             case OP_NIL:
                 push(NIL_VAL);
@@ -363,13 +535,28 @@ static InterpretResult run() {
 
             case OP_GET_UPVALUE: {
                 uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
+                push(*DEREF(ObjUpvalue, frame->closure->upvalues[slot])
+                          ->location);
                 break;
             }
 
             case OP_SET_UPVALUE: {
                 uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
+                *DEREF(ObjUpvalue, frame->closure->upvalues[slot])->location =
+                    peek(0);
+                break;
+            }
+
+            case OP_GET_OUTER_LOCAL: {
+                // Frame closures are only called from their enclosing frame.
+                uint8_t slot = READ_BYTE();
+                push(frame[-1].slots[slot]);
+                break;
+            }
+
+            case OP_SET_OUTER_LOCAL: {
+                uint8_t slot = READ_BYTE();
+                frame[-1].slots[slot] = peek(0);
                 break;
             }
 
@@ -389,7 +576,7 @@ static InterpretResult run() {
                     break;
                 }
 
-                if (!bindMethod(instance->klass, name)) {
+                if (!bindMethod(DEREF(ObjClass, instance->klass), name)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 break;
@@ -419,7 +606,136 @@ static InterpretResult run() {
                 break;
             }
 
+            case OP_BUILD_LIST: {
+                int itemCount = READ_BYTE();
+                ObjList *list = newList();
+                push(OBJ_VAL(list));
+                if (itemCount > 0) {
+                    ValueArray *items = &list->items;
+                    items->values = GROW_ARRAY(Value, NULL, 0, itemCount);
+                    items->capacity = itemCount;
+                    memcpy(items->values, vm.stackTop - 1 - itemCount,
+                           sizeof(Value) * itemCount);
+                    items->count = itemCount;
+                }
+                vm.stackTop -= itemCount + 1;
+                push(OBJ_VAL(list));
+                break;
+            }
+
+            case OP_BUILD_MAP: {
+                int entryCount = READ_BYTE();
+                ObjMap *map = newMap();
+                push(OBJ_VAL(map));
+                for (int i = entryCount; i > 0; i--) {
+                    // Keys and values alternate below the map.
+                    if (!mapKeyAt(2 * i)) return INTERPRET_RUNTIME_ERROR;
+                    valueTableSet((ValueTable *)&map->table, peek(2 * i),
+                                  peek(2 * i - 1));
+                }
+                vm.stackTop -= 2 * entryCount + 1;
+                push(OBJ_VAL(map));
+                break;
+            }
+
+            case OP_GET_INDEX: {
+                Value item;
+                int slot;
+                if (IS_LIST(peek(1))) {
+                    ObjList *list = AS_LIST(peek(1));
+                    if (!checkIndex(list->items.count, peek(0), &slot)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    item = list->items.values[slot];
+                } else if (IS_FLOAT64_ARRAY(peek(1))) {
+                    ObjFloat64Array *array = AS_FLOAT64_ARRAY(peek(1));
+                    if (!checkIndex(array->length, peek(0), &slot)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    item = NUMBER_VAL(array->values[slot]);
+                } else if (IS_MAP(peek(1))) {
+                    if (!mapKeyAt(0)) return INTERPRET_RUNTIME_ERROR;
+                    // A missing key reads as nil.
+                    if (!valueTableGet((ValueTable *)&AS_MAP(peek(1))->table,
+                                       peek(0), &item)) {
+                        item = NIL_VAL;
+                    }
+                } else {
+                    runtimeError("Only lists, maps and arrays can be indexed.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                pop();  // Index.
+                pop();  // List or map.
+                push(item);
+                break;
+            }
+
+            case OP_SET_INDEX: {
+                int slot;
+                if (IS_LIST(peek(2))) {
+                    ObjList *list = AS_LIST(peek(2));
+                    if (!checkIndex(list->items.count, peek(1), &slot)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    list->items.values[slot] = peek(0);
+                } else if (IS_FLOAT64_ARRAY(peek(2))) {
+                    ObjFloat64Array *array = AS_FLOAT64_ARRAY(peek(2));
+                    if (!checkIndex(array->length, peek(1), &slot)) {
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    if (!IS_NUMBER(peek(0))) {
+                        runtimeError("Array items must be numbers.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    array->values[slot] = AS_NUMBER(peek(0));
+                } else if (IS_MAP(peek(2))) {
+                    if (!mapKeyAt(1)) return INTERPRET_RUNTIME_ERROR;
+                    valueTableSet((ValueTable *)&AS_MAP(peek(2))->table,
+                                  peek(1), peek(0));
+                } else {
+                    runtimeError("Only lists, maps and arrays can be indexed.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                Value value = pop();
+                pop();  // Index.
+                pop();  // List or map.
+                push(value);
+                break;
+            }
+
+            case OP_LIST_APPEND: {
+                if (!IS_LIST(peek(1))) {
+                    runtimeError("Can only append to a list.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                writeValueArray(&AS_LIST(peek(1))->items, peek(0));
+                pop();  // Item.
+                pop();  // List.
+                push(NIL_VAL);
+                break;
+            }
+
+            case OP_LENGTH: {
+                int length;
+                if (IS_LIST(peek(0))) {
+                    length = AS_LIST(peek(0))->items.count;
+                } else if (IS_MAP(peek(0))) {
+                    length = AS_MAP(peek(0))->table.size;
+                } else if (IS_FLOAT64_ARRAY(peek(0))) {
+                    length = AS_FLOAT64_ARRAY(peek(0))->length;
+                } else {
+                    runtimeError("Only lists, maps and arrays have a length.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                pop();
+                push(INT_VAL(length));
+                break;
+            }
+
             case OP_EQUAL: {
+                flattenAt(0);
+                flattenAt(1);
                 Value b = pop();
                 Value a = pop();
                 push(BOOL_VAL(valuesEqual(a, b)));
@@ -427,6 +743,8 @@ static InterpretResult run() {
             }
 
             case OP_BANG_EQUAL: {
+                flattenAt(0);
+                flattenAt(1);
                 Value b = pop();
                 Value a = pop();
                 push(BOOL_VAL(!valuesEqual(a, b)));
@@ -434,25 +752,28 @@ static InterpretResult run() {
             }
 
             case OP_GREATER:
-                BINARY_OP(BOOL_VAL, >);
+                INT_BINARY_OP(BOOL_VAL, BOOL_VAL, >);
                 break;
 
             case OP_GREATER_EQUAL:
-                BINARY_OP(BOOL_VAL, >=);
+                INT_BINARY_OP(BOOL_VAL, BOOL_VAL, >=);
                 break;
 
             case OP_LESS:
-                BINARY_OP(BOOL_VAL, <);
+                INT_BINARY_OP(BOOL_VAL, BOOL_VAL, <);
                 break;
 
             case OP_LESS_EQUAL:
-                BINARY_OP(BOOL_VAL, <=);
+                INT_BINARY_OP(BOOL_VAL, BOOL_VAL, <=);
                 break;
 
             case OP_ADD:
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+                if (IS_INT(peek(0)) && IS_INT(peek(1))) {
+                    int64_t b = AS_INT(pop());
+                    int64_t a = AS_INT(pop());
+                    push(intResult(a + b));
+                } else if (isStringLike(peek(0)) && isStringLike(peek(1))) {
                     contatenate();
-                    break;
                 } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
                     double b = AS_NUMBER(pop());
                     double a = AS_NUMBER(pop());
@@ -464,7 +785,7 @@ static InterpretResult run() {
                 break;
 
             case OP_SUBTRACT:
-                BINARY_OP(NUMBER_VAL, -);
+                INT_BINARY_OP(intResult, NUMBER_VAL, -);
                 break;
 
             case OP_MULTIPLY:
@@ -488,6 +809,7 @@ static InterpretResult run() {
                 break;
 
             case OP_PRINT:
+                flattenAt(0);
                 printValue(pop());
                 printf("\n");
                 break;
@@ -506,6 +828,14 @@ static InterpretResult run() {
                 break;
             }
 
+            case OP_JUMP_IF_TRUE: {
+                uint16_t offset = READ_SHORT();
+                if (!isFalsey(peek(0))) {
+                    frame->ip += offset;
+                }
+                break;
+            }
+
             case OP_LOOP: {
                 uint16_t offset = READ_SHORT();
                 frame->ip -= offset;
@@ -521,6 +851,25 @@ static InterpretResult run() {
                 break;
             }
 
+            case OP_TAIL_CALL: {
+                int argCount = READ_BYTE();
+                if (!tailCall(peek(argCount), argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                frame = &vm.frames[vm.frameCount - 1];
+                break;
+            }
+
+            case OP_CALL_NATIVE: {
+                // The compiler bound the native and checked its arity.
+                int argCount = READ_BYTE();
+                if (!callNative(AS_NATIVE(peek(argCount)), argCount)) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                frame = &vm.frames[vm.frameCount - 1];
+                break;
+            }
+
             case OP_INVOKE: {
                 ObjString *method = READ_STRING();
                 int argCount = READ_BYTE();
@@ -551,7 +900,7 @@ static InterpretResult run() {
                     uint8_t index = READ_BYTE();
                     if (isLocal) {
                         closure->upvalues[i] =
-                            captureUpvalue(frame->slots + index);
+                            REF(captureUpvalue(frame->slots + index));
                     } else {
                         closure->upvalues[i] = frame->closure->upvalues[index];
                     }
@@ -559,6 +908,14 @@ static InterpretResult run() {
                 break;
             }
 
+            case OP_FRAME_CLOSURE: {
+                // Captures nothing; its body reads this frame's slots.
+                ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+                frame->ip += 2 * function->upvalueCount;
+                push(OBJ_VAL(newClosure(function)));
+                break;
+            }
+
             case OP_CLOSE_UPVALUE: {
                 closeUpvalues(vm.stackTop - 1);
                 pop();
@@ -576,6 +933,7 @@ static InterpretResult run() {
 
                 vm.stackTop = frame->slots;
                 push(result);
+                if (vm.frameCount == baseFrame) return INTERPRET_OK;
                 frame = &vm.frames[vm.frameCount - 1];
                 break;
             }
@@ -608,21 +966,42 @@ static InterpretResult run() {
     return INTERPRET_OK;
 #undef READ_BYTE
 #undef READ_SHORT
+#undef FRAME_CHUNK
 #undef READ_CONSTANT
 #undef READ_STRING
 #undef BINARY_OP
+#undef INT_BINARY_OP
 }
 
 InterpretResult interpret(const char *source) {
     ObjFunction *function = compile(source);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    return interpretFunction(function);
+}
 
-    push(OBJ_VAL(function));
+InterpretResult interpretFunction(ObjFunction *function) {
+    jmp_buf errorJump;
+    if (setjmp(errorJump) != 0) {
+        vm.errorJump = NULL;
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    vm.errorJump = &errorJump;
 
+    push(OBJ_VAL(function));
     ObjClosure *closure = newClosure(function);
     pop();
     push(OBJ_VAL(closure));
     call(closure, 0);
 
-    return run();
+    InterpretResult result = run(0);
+    vm.errorJump = NULL;
+    return result;
+}
+
+bool callFromNative(Value callee, int argCount) {
+    int baseFrame = vm.frameCount;
+    if (!callValue(callee, argCount)) return false;
+    // Natives and classes without an initializer are already done.
+    if (vm.frameCount == baseFrame) return true;
+    return run(baseFrame) == INTERPRET_OK;
 }
\ No newline at end of file
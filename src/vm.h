@@ -1,12 +1,22 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include <setjmp.h>
+
 #include "chunk.h"
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Default call depth limit; `clox --max-depth N` overrides it.
+#define FRAMES_MAX 100000
+// The frame and value stacks start this small and grow on demand.
+#define FRAMES_INITIAL 16
+#define STACK_INITIAL 1024
+// Concatenations at least this long produce an ObjRope instead of a copy.
+#define ROPE_MIN_LENGTH 64
+// Free stack slots guaranteed to a native call; a native that pushes more, or
+// calls back into Lox, may move the stack out from under its args.
+#define NATIVE_STACK_SLOTS 16
 
 typedef struct {
     ObjClosure *closure;
@@ -14,21 +24,29 @@ typedef struct {
     Value *slots;
 } CallFrame;
 
-typedef struct {
-    CallFrame frames[FRAMES_MAX];
+typedef struct VM {
+    CallFrame *frames;
     int frameCount;
-    Value stack[STACK_MAX];
+    int frameCapacity;
+    int maxFrames;
+    Value *stack;
     Value *stackTop;
+    Value *stackLimit;
     Table globals;
     Table strings;
     ObjString *initString;
-    ObjUpvalue *openUpvalues;
+    // The open upvalue capturing stack[i], if any; as long as the stack.
+    // Every slot from openUpvalueTop up is NULL.
+    ObjUpvalue **openUpvalues;
+    int openUpvalueTop;
+
+    // Where outOfMemory() unwinds to while a script runs, else NULL.
+    jmp_buf *errorJump;
 
     size_t bytesAllocated;
     size_t nextGC;
     int grayCount;
     int grayCapacity;
-    Obj *objects;
     Obj **grayStack;
 } VM;
 
@@ -44,7 +62,22 @@ void initVM();
 void freeVM();
 
 InterpretResult interpret(const char *source);
+// Runs a script that is already compiled.
+InterpretResult interpretFunction(ObjFunction *function);
 void push(Value value);
 Value pop();
+// Reports an error with a stack trace and unwinds the VM; the caller then
+// fails the instruction.
+void runtimeError(const char *format, ...);
+// Fails the running script with a runtime error for an allocation that can't
+// be met, unwinding straight back to interpretFunction(). Outside a script,
+// as while compiling, it reports the failure and exits.
+void outOfMemory();
+// For natives: calls callee with the argCount values on top of the stack and
+// leaves the result in callee's slot. False after a runtime error.
+bool callFromNative(Value callee, int argCount);
+// Canonicalizes the map key `distance` slots down the stack, so equal keys
+// have equal bits. False after a runtime error for an unhashable key.
+bool mapKeyAt(int distance);
 
 #endif
\ No newline at end of file